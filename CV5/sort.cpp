@@ -5,21 +5,569 @@
 #include <sys/wait.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <locale.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #define BUFFER_SIZE 1024
+#define PIPE_CAPACITY (1024 * 1024)  // requested pipe size, unprivileged only up to /proc/sys/fs/pipe-max-size
+#define COPY_CHUNK (64 * 1024)       // chunk for the read/write fallback
+#define MAX_SORT_THREADS 8
+#define MIN_LINES_PER_THREAD 16384   // smaller inputs are sorted by one thread
+#define NL_WIDTH 6                   // nl default number width
+#define NL_SEPARATOR ". "
+#define BENCH_ROUNDS 3
 
 void error_and_exit(const char* msg) {
     fprintf(stderr, "%s\n", msg);
     exit(EXIT_FAILURE);
 }
 
+// Enlarge the pipe so fewer context switches are needed per megabyte.
+// Above pipe-max-size the request fails with EPERM for unprivileged users,
+// then the largest allowed size is tried. Failure is not fatal, the pipe
+// just keeps its default 64 KiB.
+void tune_pipe(int fd) {
+    if (fcntl(fd, F_SETPIPE_SZ, PIPE_CAPACITY) >= 0 || errno != EPERM) {
+        return;
+    }
+    FILE *limit = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (!limit) {
+        return;
+    }
+    int max_size = 0;
+    if (fscanf(limit, "%d", &max_size) == 1 && max_size > fcntl(fd, F_GETPIPE_SZ)) {
+        fcntl(fd, F_SETPIPE_SZ, max_size);
+    }
+    fclose(limit);
+}
+
+// Moves the whole file into the pipe and returns the number of bytes passed.
+// splice() hands page cache pages to the pipe, so the data never enters user space.
+// Falls back to read()/write() if the file system does not support splice.
+ssize_t copy_file_to_pipe(int fd, int pipe_fd) {
+    ssize_t total_bytes = 0;
+
+    while (1) {
+        ssize_t moved = splice(fd, NULL, pipe_fd, NULL, PIPE_CAPACITY, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved > 0) {
+            total_bytes += moved;
+            continue;
+        }
+        if (moved == 0) {
+            return total_bytes; // EOF
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EINVAL || errno == ENOSYS) && total_bytes == 0) {
+            break; // splice not supported for this file, use plain copy
+        }
+        error_and_exit("splice to pipe[0][1] failed");
+    }
+
+    static char buffer[COPY_CHUNK];
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(fd, buffer, COPY_CHUNK)) > 0) {
+        ssize_t written = 0;
+        while (written < bytes_read) {
+            ssize_t len = write(pipe_fd, buffer + written, bytes_read - written);
+            if (len == -1) {
+                error_and_exit("write to pipe[0][1] failed");
+            }
+            written += len;
+        }
+        total_bytes += bytes_read;
+    }
+
+    if (bytes_read == -1) {
+        error_and_exit("read from input file failed");
+    }
+
+    return total_bytes;
+}
+
+//***************************************************************************
+// Fused mode: cat | sort | filter | nl in one process over the mapped file
+
+// One line of the mapped file, without its '\n', and its sort key
+struct LineView {
+    size_t offset;
+    size_t length;
+    size_t key_offset;  // key in g_keys for COLLATE_LOCALE, in g_data otherwise
+    size_t key_length;
+    // COLLATE_NUMERIC: significant digits of the leading number of the key,
+    // the integer part starts number_skip bytes into the key
+    unsigned number_skip;
+    unsigned int_digits;    // without leading zeros
+    unsigned frac_digits;   // without trailing zeros
+    bool negative;          // false for zero, "-0" equals "0"
+};
+
+// Comparison modes of the built-in sort stage
+enum Collation { COLLATE_BYTE, COLLATE_NUMERIC, COLLATE_FOLD, COLLATE_LOCALE };
+
+const char *g_collation_names[] = { "byte", "numeric", "fold", "locale" };
+
+struct SortOptions {
+    Collation collation;
+    int key_field;      // 1-based field where the key starts, like 'sort -k N'
+    char separator;     // field separator, 0 means blank to non-blank transition
+};
+
+typedef bool (*LineLess)(const LineView &a, const LineView &b);
+
+const char *g_data = NULL; // mapped input file
+std::string g_keys;        // strxfrm() keys of all lines, one after another
+
+int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int cmp = memcmp(a, b, std::min(a_len, b_len));
+    if (cmp) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Whole line in byte order, also the last resort when keys are equal (as 'sort' does)
+bool line_less(const LineView &a, const LineView &b) {
+    return compare_bytes(g_data + a.offset, a.length, g_data + b.offset, b.length) < 0;
+}
+
+bool key_byte_less(const LineView &a, const LineView &b) {
+    int cmp = compare_bytes(g_data + a.key_offset, a.key_length, g_data + b.key_offset, b.key_length);
+    return cmp ? cmp < 0 : line_less(a, b);
+}
+
+// Compares the absolute values digit by digit, so any length stays exact
+int compare_magnitudes(const LineView &a, const LineView &b) {
+    if (a.int_digits != b.int_digits) {
+        return a.int_digits < b.int_digits ? -1 : 1;
+    }
+    const char *x = g_data + a.key_offset + a.number_skip;
+    const char *y = g_data + b.key_offset + b.number_skip;
+    int cmp = memcmp(x, y, a.int_digits);
+    if (cmp) {
+        return cmp;
+    }
+    // fractions skip the '.', a longer one is larger as it ends with a non-zero digit
+    x += a.int_digits + 1;
+    y += b.int_digits + 1;
+    cmp = memcmp(x, y, std::min(a.frac_digits, b.frac_digits));
+    if (cmp) {
+        return cmp;
+    }
+    return (a.frac_digits > b.frac_digits) - (a.frac_digits < b.frac_digits);
+}
+
+bool key_numeric_less(const LineView &a, const LineView &b) {
+    if (a.negative != b.negative) {
+        return a.negative;
+    }
+    int cmp = compare_magnitudes(a, b);
+    if (cmp) {
+        return a.negative ? cmp > 0 : cmp < 0;
+    }
+    return line_less(a, b);
+}
+
+bool key_fold_less(const LineView &a, const LineView &b) {
+    const unsigned char *x = (const unsigned char*)g_data + a.key_offset;
+    const unsigned char *y = (const unsigned char*)g_data + b.key_offset;
+    size_t len = std::min(a.key_length, b.key_length);
+    for (size_t i = 0; i < len; i++) {
+        int cmp = toupper(x[i]) - toupper(y[i]);
+        if (cmp) {
+            return cmp < 0;
+        }
+    }
+    if (a.key_length != b.key_length) {
+        return a.key_length < b.key_length;
+    }
+    return line_less(a, b);
+}
+
+// strxfrm() keys compare with memcmp exactly like strcoll() compares the originals
+bool key_locale_less(const LineView &a, const LineView &b) {
+    int cmp = compare_bytes(g_keys.data() + a.key_offset, a.key_length, g_keys.data() + b.key_offset, b.key_length);
+    return cmp ? cmp < 0 : line_less(a, b);
+}
+
+LineLess comparator_for(Collation collation) {
+    switch (collation) {
+    case COLLATE_NUMERIC: return key_numeric_less;
+    case COLLATE_FOLD:    return key_fold_less;
+    case COLLATE_LOCALE:  return key_locale_less;
+    default:              return key_byte_less;
+    }
+}
+
+// Finds the key of the line: from the start of field key_field up to the end of the line
+void find_key(LineView &line, const SortOptions &options) {
+    const char *text = g_data + line.offset;
+    size_t pos = 0;
+
+    for (int field = 1; field < options.key_field && pos < line.length; field++) {
+        if (options.separator) {
+            const char *sep = (const char*)memchr(text + pos, options.separator, line.length - pos);
+            pos = sep ? sep - text + 1 : line.length;
+        } else {
+            while (pos < line.length && isblank((unsigned char)text[pos])) pos++;
+            while (pos < line.length && !isblank((unsigned char)text[pos])) pos++;
+        }
+    }
+
+    line.key_offset = line.offset + pos;
+    line.key_length = line.length - pos;
+}
+
+// Leading number of the key like 'sort -n': blanks, optional '-', digits, '.' and fraction.
+// Anything that is not a number counts as zero. Only the position and length
+// of the digits are kept, 'sort -n' compares them as strings, not as doubles.
+void parse_number(LineView &line) {
+    const char *text = g_data + line.key_offset;
+    size_t length = line.key_length;
+    size_t pos = 0;
+    while (pos < length && isblank((unsigned char)text[pos])) pos++;
+
+    bool negative = pos < length && text[pos] == '-';
+    if (negative) pos++;
+
+    while (pos < length && text[pos] == '0') pos++;
+    size_t start = pos;
+    while (pos < length && isdigit((unsigned char)text[pos])) pos++;
+    line.number_skip = start;
+    line.int_digits = pos - start;
+
+    size_t frac_end = pos;
+    if (pos < length && text[pos] == '.') {
+        for (pos++; pos < length && isdigit((unsigned char)text[pos]); pos++) {
+            if (text[pos] != '0') {
+                frac_end = pos + 1;
+            }
+        }
+    }
+    line.frac_digits = frac_end > start + line.int_digits ? frac_end - (start + line.int_digits) - 1 : 0;
+    line.negative = negative && (line.int_digits || line.frac_digits);
+}
+
+// Computes the per-line key once, so the comparisons themselves stay cheap
+void prepare_keys(std::vector<LineView> &lines, const SortOptions &options) {
+    g_keys.clear();
+    std::string text;
+    std::vector<char> xfrm(256);
+
+    for (LineView &line : lines) {
+        find_key(line, options);
+
+        if (options.collation == COLLATE_NUMERIC) {
+            parse_number(line);
+        } else if (options.collation == COLLATE_LOCALE) {
+            text.assign(g_data + line.key_offset, line.key_length); // strxfrm needs '\0'
+            size_t len = strxfrm(xfrm.data(), text.c_str(), xfrm.size());
+            if (len >= xfrm.size()) {
+                xfrm.resize(len + 1);
+                strxfrm(xfrm.data(), text.c_str(), xfrm.size());
+            }
+            line.key_offset = g_keys.size();
+            line.key_length = len;
+            g_keys.append(xfrm.data(), len);
+        }
+    }
+}
+
+struct SortRange {
+    LineView *begin;
+    LineView *end;
+};
+
+LineLess g_less = key_byte_less; // comparator of the current sort
+
+void* sort_range(void *arg) {
+    SortRange *range = (SortRange*)arg;
+    std::sort(range->begin, range->end, g_less);
+    return NULL;
+}
+
+// Sorts the slices in parallel, then merges neighbouring runs until one is left
+void parallel_sort(std::vector<LineView> &lines, Collation collation) {
+    g_less = comparator_for(collation);
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = std::min<long>(threads, MAX_SORT_THREADS);
+    threads = std::min<long>(threads, lines.size() / MIN_LINES_PER_THREAD);
+
+    if (threads <= 1) {
+        std::sort(lines.begin(), lines.end(), g_less);
+        return;
+    }
+
+    std::vector<size_t> bounds(threads + 1);
+    for (long i = 0; i <= threads; i++) {
+        bounds[i] = lines.size() * i / threads;
+    }
+
+    std::vector<pthread_t> tids(threads);
+    std::vector<SortRange> ranges(threads);
+    for (long i = 0; i < threads; i++) {
+        ranges[i].begin = lines.data() + bounds[i];
+        ranges[i].end = lines.data() + bounds[i + 1];
+        if (pthread_create(&tids[i], NULL, sort_range, &ranges[i]) != 0) {
+            error_and_exit("pthread_create failed");
+        }
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (long step = 1; step < threads; step *= 2) {
+        for (long i = 0; i + step < threads; i += 2 * step) {
+            long last = std::min(i + 2 * step, threads);
+            std::inplace_merge(lines.begin() + bounds[i], lines.begin() + bounds[i + step],
+                               lines.begin() + bounds[last], g_less);
+        }
+    }
+}
+
+// Line that keeps the filter stage quiet: it has no upper or lower case filter_char
+bool line_passes(const LineView &line, char filter_char) {
+    if (!filter_char) {
+        return false; // strchr(line, '\0') always matches
+    }
+    const char *text = g_data + line.offset;
+    return !memchr(text, toupper(filter_char), line.length) && !memchr(text, tolower(filter_char), line.length);
+}
+
+// nl logical page sections, only body lines get numbers by default
+enum NlSection { NL_NONE, NL_HEADER, NL_BODY, NL_FOOTER };
+
+// Returns the section started by a delimiter line, or NL_NONE for a normal line
+NlSection nl_delimiter(const LineView &line) {
+    const char *text = g_data + line.offset;
+    if (line.length == 6 && !memcmp(text, "\\:\\:\\:", 6)) return NL_HEADER;
+    if (line.length == 4 && !memcmp(text, "\\:\\:", 4)) return NL_BODY;
+    if (line.length == 2 && !memcmp(text, "\\:", 2)) return NL_FOOTER;
+    return NL_NONE;
+}
+
+void write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t len = write(fd, data, size);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_and_exit("write to stdout failed");
+        }
+        data += len;
+        size -= len;
+    }
+}
+
+// Maps the file and builds the line index, a missing final '\n' is added like 'sort' does
+size_t load_input(const char *filename, std::vector<LineView> &lines) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        error_and_exit("open file failed");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        error_and_exit("fstat failed");
+    }
+    size_t size = st.st_size;
+
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            error_and_exit("mmap failed");
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        g_data = (const char*)map;
+    }
+    close(fd);
+
+    size_t start = 0;
+    while (start < size) {
+        const char *eol = (const char*)memchr(g_data + start, '\n', size - start);
+        size_t end = eol ? eol - g_data : size;
+        lines.push_back({start, end - start, start, end - start, 0});
+        start = end + 1;
+    }
+
+    return size;
+}
+
+int run_fused(const char *filename, char filter_char, const SortOptions &options) {
+    std::vector<LineView> lines;
+    size_t size = load_input(filename, lines);
+
+    prepare_keys(lines, options);
+    parallel_sort(lines, options.collation);
+
+    // Filter and number in one pass, same output as 'nl -s ". "'
+    std::string out;
+    out.reserve(size + lines.size() * (NL_WIDTH + strlen(NL_SEPARATOR)));
+    char number[32];
+    int line_number = 1;
+    NlSection section = NL_BODY;
+
+    for (const LineView &line : lines) {
+        if (!line_passes(line, filter_char)) {
+            continue;
+        }
+
+        NlSection delimiter = nl_delimiter(line);
+        if (delimiter != NL_NONE) {
+            // nl prints an empty line instead and restarts numbering
+            section = delimiter;
+            out += '\n';
+            line_number = 1;
+            continue;
+        }
+
+        if (line.length == 0 || section != NL_BODY) {
+            out.append(NL_WIDTH + strlen(NL_SEPARATOR), ' ');
+            out.append(g_data + line.offset, line.length);
+        } else {
+            int len = snprintf(number, sizeof(number), "%*d" NL_SEPARATOR, NL_WIDTH, line_number++);
+            out.append(number, len);
+            out.append(g_data + line.offset, line.length);
+        }
+        out += '\n';
+    }
+
+    write_all(STDOUT_FILENO, out.data(), out.size());
+
+    if (size > 0) {
+        munmap((void*)g_data, size);
+    }
+
+    fprintf(stderr, "Bytes passed: %ld\n", (long)size);
+    return 0;
+}
+
+//***************************************************************************
+// Benchmark of the comparison modes
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sorts the file with every collation and prints the best of BENCH_ROUNDS runs
+int run_bench(const char *filename, SortOptions options) {
+    std::vector<LineView> input;
+    size_t size = load_input(filename, input);
+
+    printf("%-8s %10s %10s %12s %10s\n", "mode", "keys ms", "sort ms", "lines/s", "MB/s");
+
+    for (int c = COLLATE_BYTE; c <= COLLATE_LOCALE; c++) {
+        options.collation = (Collation)c;
+        double best_keys = 0, best_total = 0;
+
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            std::vector<LineView> lines = input;
+
+            double start = now_seconds();
+            prepare_keys(lines, options);
+            double keys_done = now_seconds();
+            parallel_sort(lines, options.collation);
+            double total = now_seconds() - start;
+
+            if (round == 0 || total < best_total) {
+                best_total = total;
+                best_keys = keys_done - start;
+            }
+        }
+
+        printf("%-8s %10.1f %10.1f %12.0f %10.1f\n", g_collation_names[c],
+               best_keys * 1e3, (best_total - best_keys) * 1e3,
+               input.size() / best_total, size / best_total / 1e6);
+    }
+
+    return 0;
+}
+
+bool parse_collation(const char *name, Collation *collation) {
+    for (int c = COLLATE_BYTE; c <= COLLATE_LOCALE; c++) {
+        if (!strcmp(name, g_collation_names[c])) {
+            *collation = (Collation)c;
+            return true;
+        }
+    }
+    return false;
+}
+
+void usage_and_exit() {
+    error_and_exit(
+        "Usage: ./sort [--fused] [-m mode] [-k field] [-t sep] <input_file> <character>\n"
+        "       ./sort --bench [-k field] [-t sep] <input_file>\n"
+        "  mode: byte, numeric, fold or locale (default follows LC_COLLATE)");
+}
+
 int main(int argc, char* argv[]) {
-    if(argc != 3) {
-        error_and_exit("Usage: ./sort <input_file> <character>");
+    bool fused = false;
+    bool bench = false;
+    bool collation_set = false;
+    SortOptions options = { COLLATE_BYTE, 1, 0 };
+    char *positional[2];
+    int num_positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--fused")) {
+            fused = true;
+        } else if (!strcmp(argv[i], "--bench")) {
+            bench = true;
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            if (!parse_collation(argv[++i], &options.collation)) {
+                usage_and_exit();
+            }
+            collation_set = true;
+        } else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+            options.key_field = atoi(argv[++i]);
+            if (options.key_field < 1) {
+                usage_and_exit();
+            }
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            options.separator = argv[++i][0];
+        } else if (num_positional < 2) {
+            positional[num_positional++] = argv[i];
+        } else {
+            usage_and_exit();
+        }
+    }
+
+    if (num_positional != (bench ? 1 : 2)) {
+        usage_and_exit();
+    }
+
+    // Only collation follows the environment, ctype stays "C" for the filter stage
+    setlocale(LC_COLLATE, "");
+    if (!collation_set) {
+        const char *locale = setlocale(LC_COLLATE, NULL);
+        if (strcmp(locale, "C") && strcmp(locale, "POSIX")) {
+            options.collation = COLLATE_LOCALE;
+        }
+    }
+
+    if (bench) {
+        return run_bench(positional[0], options);
+    }
+
+    if (fused) {
+        return run_fused(positional[0], positional[1][0], options);
     }
 
-    char *filename = argv[1];
-    char filter_char = argv[2][0];
+    char *filename = positional[0];
+    char filter_char = positional[1][0];
 
     int pipes[3][2];
 
@@ -28,6 +576,7 @@ int main(int argc, char* argv[]) {
         if (pipe(pipes[i]) == -1) {
             error_and_exit("pipe creation failed");
         }
+        tune_pipe(pipes[i][1]);
     }
 
     // First child to mimics cat
@@ -43,16 +592,7 @@ int main(int argc, char* argv[]) {
             error_and_exit("open file failed");
         }
 
-        char buffer[BUFFER_SIZE];
-        ssize_t bytes_read;
-        ssize_t total_bytes = 0;
-
-        while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-            total_bytes += bytes_read;
-            if (write(pipes[0][1], buffer, bytes_read) == -1) {
-                error_and_exit("write to pipe[0][1] failed"); 
-            }
-        }
+        ssize_t total_bytes = copy_file_to_pipe(fd, pipes[0][1]);
 
         close(fd);
         close(pipes[0][1]);
@@ -82,8 +622,30 @@ int main(int argc, char* argv[]) {
         }
         close(pipes[1][1]);
 
+        // Same ordering as the built-in sort stage
+        char key_arg[16], sep_arg[2] = { options.separator, 0 };
+        const char *sort_args[8];
+        int n = 0;
+        sort_args[n++] = "sort";
+        if (options.collation == COLLATE_NUMERIC) sort_args[n++] = "-n";
+        if (options.collation == COLLATE_FOLD) sort_args[n++] = "-f";
+        if (options.separator) {
+            sort_args[n++] = "-t";
+            sort_args[n++] = sep_arg;
+        }
+        if (options.key_field > 1) {
+            snprintf(key_arg, sizeof(key_arg), "%d", options.key_field);
+            sort_args[n++] = "-k";
+            sort_args[n++] = key_arg;
+        }
+        sort_args[n] = NULL;
+
+        if (collation_set && options.collation != COLLATE_LOCALE) {
+            setenv("LC_ALL", "C", 1);
+        }
+
         // Execute 'sort'
-        execlp("sort", "sort", NULL);
+        execvp("sort", (char* const*)sort_args);
         error_and_exit("execlp sort failed");
     }
 
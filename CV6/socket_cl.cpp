@@ -7,6 +7,7 @@
 // Modified Socket Client.
 //
 // The client records all communication with the server into a file.
+// With -b it sends a whole script of commands at once and measures them.
 //
 //***************************************************************************
 
@@ -27,8 +28,15 @@
 #include <errno.h>
 #include <netdb.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
 
 #define STR_CLOSE "close"
+#define STR_PIPELINE "pipeline"
 
 //***************************************************************************
 // log messages
@@ -69,24 +77,188 @@ void log_msg(int t_log_level, const char *t_form, ...)
     }
 }
 
+//***************************************************************************
+// session log
+//
+// The receive path only copies data into a ring buffer. A background thread
+// drains it into the log file with large writes, so a slow disk never stalls
+// the connection. There is one producer and one consumer, so two atomic
+// counters are enough. When the ring is full, data for the log is dropped
+// and counted instead of waiting for the disk.
+
+#define LOG_RING_SIZE           (4 * 1024 * 1024)   // power of 2
+#define LOG_IDLE_US             10000   // sleep of the log thread on empty ring
+#define LOG_SYNC_MS             1000    // fdatasync period of SYNC_PERIODIC
+
+enum SyncPolicy
+{
+    SYNC_NONE,                          // leave it to the kernel
+    SYNC_PERIODIC,                      // fdatasync every LOG_SYNC_MS
+    SYNC_ALWAYS                         // fdatasync after every write
+};
+
+struct SessionLog
+{
+    int fd;
+    SyncPolicy policy;
+    char *ring;
+    std::atomic<size_t> head;           // bytes put by the receive path
+    std::atomic<size_t> tail;           // bytes written to the file
+    std::atomic<bool> stop;
+    long dropped;                       // bytes that did not fit into the ring
+    pthread_t thread;
+};
+
+SessionLog g_session_log;
+
+long now_us()
+{
+    timespec l_ts;
+    clock_gettime(CLOCK_MONOTONIC, &l_ts);
+    return l_ts.tv_sec * 1000000L + l_ts.tv_nsec / 1000;
+}
+
+void *session_log_thread(void *t_arg)
+{
+    SessionLog *l_log = (SessionLog *)t_arg;
+    long l_synced = now_us();
+    bool l_dirty = false;
+
+    while (1)
+    {
+        // stop is read before head, so everything put before stop gets written
+        bool l_stop = l_log->stop.load(std::memory_order_acquire);
+        size_t l_head = l_log->head.load(std::memory_order_acquire);
+        size_t l_tail = l_log->tail.load(std::memory_order_relaxed);
+
+        if (l_head == l_tail)
+        {
+            if (l_stop)
+                break;
+            if (l_dirty && l_log->policy == SYNC_PERIODIC && now_us() - l_synced >= LOG_SYNC_MS * 1000L)
+            {
+                fdatasync(l_log->fd);
+                l_synced = now_us();
+                l_dirty = false;
+            }
+            usleep(LOG_IDLE_US);
+            continue;
+        }
+
+        // all pending data at once, in two parts when it wraps around
+        size_t l_pos = l_tail & (LOG_RING_SIZE - 1);
+        size_t l_len = l_head - l_tail;
+        iovec l_iov[2];
+        int l_parts = 1;
+        l_iov[0].iov_base = l_log->ring + l_pos;
+        l_iov[0].iov_len = std::min(l_len, (size_t)LOG_RING_SIZE - l_pos);
+        if (l_iov[0].iov_len < l_len)
+        {
+            l_iov[1].iov_base = l_log->ring;
+            l_iov[1].iov_len = l_len - l_iov[0].iov_len;
+            l_parts = 2;
+        }
+
+        ssize_t l_written = writev(l_log->fd, l_iov, l_parts);
+        if (l_written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERROR, "Unable to write to log file.");
+            l_written = l_len; // drop it, the receive path must go on
+        }
+        l_log->tail.store(l_tail + l_written, std::memory_order_release);
+        l_dirty = true;
+
+        if (l_log->policy == SYNC_ALWAYS ||
+            (l_log->policy == SYNC_PERIODIC && now_us() - l_synced >= LOG_SYNC_MS * 1000L))
+        {
+            fdatasync(l_log->fd);
+            l_synced = now_us();
+            l_dirty = false;
+        }
+    }
+    return NULL;
+}
+
+bool session_log_open(const char *t_name, SyncPolicy t_policy)
+{
+    SessionLog *l_log = &g_session_log;
+    l_log->fd = open(t_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (l_log->fd < 0)
+        return false;
+
+    l_log->policy = t_policy;
+    l_log->ring = (char *)malloc(LOG_RING_SIZE);
+    l_log->head = 0;
+    l_log->tail = 0;
+    l_log->stop = false;
+    l_log->dropped = 0;
+    if (pthread_create(&l_log->thread, NULL, session_log_thread, l_log))
+    {
+        close(l_log->fd);
+        return false;
+    }
+    return true;
+}
+
+// Called from the receive path, never blocks
+void session_log_put(const char *t_buf, size_t t_len)
+{
+    SessionLog *l_log = &g_session_log;
+    size_t l_head = l_log->head.load(std::memory_order_relaxed);
+    size_t l_tail = l_log->tail.load(std::memory_order_acquire);
+    if (LOG_RING_SIZE - (l_head - l_tail) < t_len)
+    {
+        l_log->dropped += t_len;
+        return;
+    }
+
+    size_t l_pos = l_head & (LOG_RING_SIZE - 1);
+    size_t l_first = std::min(t_len, (size_t)LOG_RING_SIZE - l_pos);
+    memcpy(l_log->ring + l_pos, t_buf, l_first);
+    memcpy(l_log->ring, t_buf + l_first, t_len - l_first);
+    l_log->head.store(l_head + t_len, std::memory_order_release);
+}
+
+// Writes the rest of the ring and closes the file
+void session_log_close()
+{
+    SessionLog *l_log = &g_session_log;
+    l_log->stop.store(true, std::memory_order_release);
+    pthread_join(l_log->thread, NULL);
+    if (l_log->policy != SYNC_NONE)
+        fdatasync(l_log->fd);
+    close(l_log->fd);
+    free(l_log->ring);
+    if (l_log->dropped)
+        log_msg(LOG_INFO, "Log file is missing %ld bytes, the disk was too slow.", l_log->dropped);
+}
+
 //***************************************************************************
 // help
 
+void usage(char *t_prog)
+{
+    printf(
+        "\n"
+        "  Socket client example.\n"
+        "\n"
+        "  Use: %s [-h -d -b script -s sync] ip_or_name port_number [log_file]\n"
+        "\n"
+        "    -d  debug mode \n"
+        "    -b  send all commands from script at once, report their latency\n"
+        "    -s  log file sync: none, periodic (default, every %d ms) or always\n"
+        "    -h  this help\n"
+        "\n",
+        t_prog, LOG_SYNC_MS);
+}
+
 void help(int t_narg, char **t_args)
 {
     if (t_narg <= 1 || !strcmp(t_args[1], "-h"))
     {
-        printf(
-            "\n"
-            "  Socket client example.\n"
-            "\n"
-            "  Use: %s [-h -d] ip_or_name port_number [log_file]\n"
-            "\n"
-            "    -d  debug mode \n"
-            "    -h  this help\n"
-            "\n",
-            t_args[0]);
-
+        usage(t_args[0]);
         exit(0);
     }
 
@@ -94,6 +266,257 @@ void help(int t_narg, char **t_args)
         g_debug = LOG_DEBUG;
 }
 
+//***************************************************************************
+// batch mode
+//
+// All commands of the script are sent back-to-back after 'pipeline', so the
+// server runs them concurrently and frames their output as
+// '#<id> out <len>' and '#<id> exit <status>'. The server numbers commands
+// from 1 in the order they arrive, which maps ids back to script lines.
+// A server without framing gets the script too, but only the total time
+// can be measured.
+
+struct BatchCommand
+{
+    std::string line;
+    size_t end;                         // offset behind the line in the send buffer
+    long sent;                          // us, when the line was passed to the kernel
+    long done;                          // us, when the exit frame arrived, 0 = pending
+    int status;
+    long bytes;                         // output of the command
+};
+
+// Reads commands of the script, empty lines are skipped like on the server
+bool load_script(const char *t_name, std::vector<BatchCommand> &t_cmds)
+{
+    FILE *l_file = fopen(t_name, "r");
+    if (!l_file)
+        return false;
+
+    char *l_line = NULL;
+    size_t l_size = 0;
+    ssize_t l_len;
+    while ((l_len = getline(&l_line, &l_size, l_file)) >= 0)
+    {
+        while (l_len > 0 && (l_line[l_len - 1] == '\n' || l_line[l_len - 1] == '\r'))
+            l_line[--l_len] = '\0';
+        if (strspn(l_line, " \t") == (size_t)l_len)
+            continue;
+        if (!strncasecmp(l_line, STR_CLOSE, strlen(STR_CLOSE)))
+            break; // the server would drop the rest
+
+        BatchCommand l_cmd = {};
+        l_cmd.line = l_line;
+        t_cmds.push_back(l_cmd);
+    }
+    free(l_line);
+    fclose(l_file);
+    return true;
+}
+
+// Consumes complete frames from t_in, returns false on a broken frame
+bool parse_frames(std::string &t_in, std::vector<BatchCommand> &t_cmds, int &t_out_id, long &t_out_left, int &t_finished)
+{
+    size_t l_pos = 0;
+    while (l_pos < t_in.size())
+    {
+        if (t_out_left > 0)
+        {
+            long l_take = std::min(t_out_left, (long)(t_in.size() - l_pos));
+            if (t_out_id >= 1 && t_out_id <= (int)t_cmds.size())
+                t_cmds[t_out_id - 1].bytes += l_take;
+            t_out_left -= l_take;
+            l_pos += l_take;
+            continue;
+        }
+
+        size_t l_eol = t_in.find('\n', l_pos);
+        if (l_eol == std::string::npos)
+            break;
+
+        std::string l_head = t_in.substr(l_pos, l_eol - l_pos);
+        l_pos = l_eol + 1;
+
+        int l_id;
+        char l_kind[16];
+        long l_value;
+        if (sscanf(l_head.c_str(), "#%d %15s %ld", &l_id, l_kind, &l_value) != 3)
+        {
+            log_msg(LOG_INFO, "Unexpected line from server: '%s'", l_head.c_str());
+            return false;
+        }
+
+        if (!strcmp(l_kind, "out"))
+        {
+            t_out_id = l_id;
+            t_out_left = l_value;
+        }
+        else if (!strcmp(l_kind, "exit") && l_id >= 1 && l_id <= (int)t_cmds.size())
+        {
+            BatchCommand &l_cmd = t_cmds[l_id - 1];
+            if (!l_cmd.done)
+                t_finished++;
+            l_cmd.done = now_us();
+            l_cmd.status = l_value;
+        }
+        else if (!strcmp(l_kind, STR_PIPELINE))
+            log_msg(LOG_INFO, "Server runs up to %ld commands at once.", l_value);
+    }
+    t_in.erase(0, l_pos);
+    return true;
+}
+
+void batch_report(std::vector<BatchCommand> &t_cmds, long t_total_us, bool t_framed)
+{
+    std::vector<long> l_lat;
+    if (t_framed)
+    {
+        printf("%6s %10s %6s %10s  %s\n", "id", "ms", "exit", "bytes", "command");
+        for (size_t i = 0; i < t_cmds.size(); i++)
+        {
+            BatchCommand &l_cmd = t_cmds[i];
+            if (!l_cmd.done)
+            {
+                printf("%6d %10s %6s %10ld  %s\n", (int)i + 1, "-", "-", l_cmd.bytes, l_cmd.line.c_str());
+                continue;
+            }
+            long l_us = l_cmd.done - l_cmd.sent;
+            l_lat.push_back(l_us);
+            printf("%6d %10.3f %6d %10ld  %s\n", (int)i + 1, l_us / 1000.0, l_cmd.status, l_cmd.bytes, l_cmd.line.c_str());
+        }
+    }
+
+    double l_sec = t_total_us / 1e6;
+    log_msg(LOG_INFO, "%d commands in %.3f s, %.1f commands/s.",
+            (int)t_cmds.size(), l_sec, l_sec > 0 ? t_cmds.size() / l_sec : 0.0);
+    if (t_framed && l_lat.size() < t_cmds.size())
+        log_msg(LOG_INFO, "%d commands without result.", (int)(t_cmds.size() - l_lat.size()));
+    if (l_lat.empty())
+        return;
+
+    std::sort(l_lat.begin(), l_lat.end());
+    long l_sum = 0;
+    for (long l_us : l_lat)
+        l_sum += l_us;
+    log_msg(LOG_INFO, "Latency ms: min %.3f  avg %.3f  p50 %.3f  p99 %.3f  max %.3f",
+            l_lat.front() / 1000.0, l_sum / 1000.0 / l_lat.size(),
+            l_lat[l_lat.size() / 2] / 1000.0, l_lat[l_lat.size() * 99 / 100] / 1000.0,
+            l_lat.back() / 1000.0);
+}
+
+int run_batch(int t_sock, const char *t_script)
+{
+    std::vector<BatchCommand> l_cmds;
+    if (!load_script(t_script, l_cmds))
+    {
+        log_msg(LOG_ERROR, "Unable to read script '%s'.", t_script);
+        return 1;
+    }
+    log_msg(LOG_INFO, "Sending %d commands from '%s'.", (int)l_cmds.size(), t_script);
+
+    std::string l_out = STR_PIPELINE "\n";
+    for (BatchCommand &l_cmd : l_cmds)
+    {
+        l_out += l_cmd.line + "\n";
+        l_cmd.end = l_out.size();
+    }
+
+    // the socket must not block in send() while the server waits for us to read
+    fcntl(t_sock, F_SETFL, fcntl(t_sock, F_GETFL) | O_NONBLOCK);
+
+    std::string l_in;
+    size_t l_sent = 0;
+    size_t l_next = 0;                  // first command not sent completely
+    int l_finished = 0;
+    int l_out_id = 0;
+    long l_out_left = 0;
+    int l_framed = -1;                  // -1 until the first line from server
+    bool l_closing = false;
+    long l_start = now_us();
+
+    while (1)
+    {
+        pollfd l_poll = {t_sock, POLLIN, 0};
+        if (l_sent < l_out.size())
+            l_poll.events |= POLLOUT;
+
+        if (poll(&l_poll, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERROR, "Poll failed.");
+            break;
+        }
+
+        if (l_poll.revents & POLLOUT)
+        {
+            ssize_t l_len = send(t_sock, l_out.data() + l_sent, l_out.size() - l_sent, MSG_NOSIGNAL);
+            if (l_len < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                log_msg(LOG_ERROR, "Unable to send data to server.");
+                break;
+            }
+            if (l_len > 0)
+            {
+                l_sent += l_len;
+                long l_now = now_us();
+                while (l_next < l_cmds.size() && l_cmds[l_next].end <= l_sent)
+                    l_cmds[l_next++].sent = l_now;
+                log_msg(LOG_DEBUG, "Sent %d bytes to server.", (int)l_len);
+            }
+        }
+
+        if (!(l_poll.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        char l_buf[65536];
+        ssize_t l_len = read(t_sock, l_buf, sizeof(l_buf));
+        if (l_len < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (l_len < 0)
+        {
+            log_msg(LOG_ERROR, "Unable to read data from server.");
+            break;
+        }
+        if (!l_len)
+        {
+            log_msg(LOG_DEBUG, "Server closed socket.");
+            break;
+        }
+        log_msg(LOG_DEBUG, "Read %d bytes from server.", (int)l_len);
+
+        session_log_put(l_buf, l_len);
+        l_in.append(l_buf, l_len);
+
+        if (l_framed < 0 && l_in.find('\n') != std::string::npos)
+        {
+            l_framed = !strncmp(l_in.c_str(), "#0 " STR_PIPELINE " ", strlen("#0 " STR_PIPELINE " "));
+            if (!l_framed)
+            {
+                // output is not framed, the server closes after the last command
+                log_msg(LOG_INFO, "Server does not frame output, only the total time is measured.");
+                l_out += STR_CLOSE "\n";
+            }
+        }
+
+        if (l_framed == 1)
+        {
+            if (!parse_frames(l_in, l_cmds, l_out_id, l_out_left, l_finished))
+                break;
+            if (l_finished == (int)l_cmds.size() && !l_closing)
+            {
+                l_closing = true;
+                l_out += STR_CLOSE "\n";
+            }
+        }
+        else
+            l_in.clear();
+    }
+
+    batch_report(l_cmds, now_us() - l_start, l_framed == 1);
+    return l_framed == 1 && l_finished < (int)l_cmds.size() ? 1 : 0;
+}
+
 //***************************************************************************
 
 int main(int t_narg, char **t_args)
@@ -105,6 +528,8 @@ int main(int t_narg, char **t_args)
     int l_port = 0;
     char *l_host = NULL;
     char *log_file_name = NULL;
+    char *l_script = NULL;
+    SyncPolicy l_sync = SYNC_PERIODIC;
 
     // parsing arguments
     for (int i = 1; i < t_narg; i++)
@@ -115,6 +540,26 @@ int main(int t_narg, char **t_args)
         else if (!strcmp(t_args[i], "-h"))
             help(t_narg, t_args);
 
+        else if (!strcmp(t_args[i], "-b") && i + 1 < t_narg)
+            l_script = t_args[++i];
+
+        else if (!strcmp(t_args[i], "-s") && i + 1 < t_narg)
+        {
+            const char *l_policy = t_args[++i];
+            if (!strcmp(l_policy, "none"))
+                l_sync = SYNC_NONE;
+            else if (!strcmp(l_policy, "always"))
+                l_sync = SYNC_ALWAYS;
+            else if (!strcmp(l_policy, "periodic"))
+                l_sync = SYNC_PERIODIC;
+            else
+            {
+                log_msg(LOG_INFO, "Unknown log file sync '%s'!", l_policy);
+                usage(t_args[0]);
+                exit(1);
+            }
+        }
+
         else if (*t_args[i] != '-')
         {
             if (!l_host)
@@ -150,8 +595,7 @@ int main(int t_narg, char **t_args)
     log_msg(LOG_INFO, "Logging communication to file: %s", log_file_name);
 
     // Open the log file
-    FILE *log_file = fopen(log_file_name, "w");
-    if (!log_file)
+    if (!session_log_open(log_file_name, l_sync))
     {
         log_msg(LOG_ERROR, "Unable to open log file.");
         exit(1);
@@ -200,6 +644,14 @@ int main(int t_narg, char **t_args)
     log_msg(LOG_INFO, "Server IP: '%s'  port: %d",
             inet_ntoa(l_cl_addr.sin_addr), ntohs(l_cl_addr.sin_port));
 
+    if (l_script)
+    {
+        int l_ret = run_batch(l_sock_server, l_script);
+        close(l_sock_server);
+        session_log_close();
+        return l_ret;
+    }
+
     log_msg(LOG_INFO, "Enter 'close' to close connection.");
 
     // list of fd sources
@@ -269,14 +721,8 @@ int main(int t_narg, char **t_args)
             if (write_len < 0)
                 log_msg(LOG_ERROR, "Unable to write to stdout.");
 
-            // write to log file
-            int log_write_len = fwrite(l_buf, 1, l_len, log_file);
-            
-            if (log_write_len != l_len)
-            {
-                log_msg(LOG_ERROR, "Unable to write to log file.");
-            }
-            fflush(log_file); // Ensure data is written to file
+            // write to log file, done by the log thread
+            session_log_put(l_buf, l_len);
 
             // request to close?
             if (!strncasecmp(l_buf, STR_CLOSE, strlen(STR_CLOSE)))
@@ -289,7 +735,7 @@ int main(int t_narg, char **t_args)
 
     // close socket
     close(l_sock_server);
-    fclose(log_file);
+    session_log_close();
 
     // Free allocated memory if log file name was auto-generated
     if (!t_args[3])
@@ -0,0 +1,836 @@
+//***************************************************************************
+//
+// Program example for subject Operating Systems
+//
+// Load generator for the command server.
+//
+// Opens many connections from a few threads, each thread with its own epoll
+// set, switches every connection to pipelined commands and replays a mix of
+// commands at a target rate. Connect latency, latency of every command and
+// errors are printed as CSV or JSON.
+//
+//***************************************************************************
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define STR_CLOSE "close"
+#define STR_PIPELINE "pipeline"
+
+//***************************************************************************
+// log messages
+
+#define LOG_ERROR 0 // errors
+#define LOG_INFO 1  // information and notifications
+#define LOG_DEBUG 2 // debug messages
+
+// debug flag
+int g_debug = LOG_INFO;
+
+// Messages go to stderr, stdout is left for the results
+void log_msg(int t_log_level, const char *t_form, ...)
+{
+    const char *out_fmt[] = {
+        "ERR: (%d-%s) %s\n",
+        "INF: %s\n",
+        "DEB: %s\n"};
+
+    if (t_log_level && t_log_level > g_debug)
+        return;
+
+    char l_buf[1024];
+    va_list l_arg;
+    va_start(l_arg, t_form);
+    vsnprintf(l_buf, sizeof(l_buf), t_form, l_arg);
+    va_end(l_arg);
+
+    switch (t_log_level)
+    {
+    case LOG_INFO:
+    case LOG_DEBUG:
+        fprintf(stderr, out_fmt[t_log_level], l_buf);
+        break;
+
+    case LOG_ERROR:
+        fprintf(stderr, out_fmt[t_log_level], errno, strerror(errno), l_buf);
+        break;
+    }
+}
+
+//***************************************************************************
+// latency histogram
+//
+// Values below 16 us have their own bucket, above that every power of two
+// is split into 8 buckets, so the error of a percentile is below 12.5 %.
+
+#define HIST_LINEAR             16
+#define HIST_SUB                8
+#define HIST_BUCKETS            (HIST_LINEAR + 40 * HIST_SUB)
+
+struct Histogram
+{
+    long count;
+    long failed;                        // exit status other than 0, or no answer
+    long sum;                           // us
+    long max;                           // us
+    long buckets[HIST_BUCKETS];
+};
+
+int hist_index(long t_us)
+{
+    if (t_us < HIST_LINEAR)
+        return t_us < 0 ? 0 : t_us;
+    int l_exp = 63 - __builtin_clzl(t_us); // >= 4
+    int l_sub = (t_us >> (l_exp - 3)) & (HIST_SUB - 1);
+    return std::min(HIST_LINEAR + (l_exp - 4) * HIST_SUB + l_sub, HIST_BUCKETS - 1);
+}
+
+// Lowest value of the bucket
+long hist_value(int t_index)
+{
+    if (t_index < HIST_LINEAR)
+        return t_index;
+    int l_exp = (t_index - HIST_LINEAR) / HIST_SUB + 4;
+    int l_sub = (t_index - HIST_LINEAR) % HIST_SUB;
+    return (long)(HIST_SUB + l_sub) << (l_exp - 3);
+}
+
+void hist_add(Histogram *t_hist, long t_us)
+{
+    t_hist->count++;
+    t_hist->sum += t_us;
+    t_hist->max = std::max(t_hist->max, t_us);
+    t_hist->buckets[hist_index(t_us)]++;
+}
+
+void hist_merge(Histogram *t_to, const Histogram *t_from)
+{
+    t_to->count += t_from->count;
+    t_to->failed += t_from->failed;
+    t_to->sum += t_from->sum;
+    t_to->max = std::max(t_to->max, t_from->max);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        t_to->buckets[i] += t_from->buckets[i];
+}
+
+// Upper bound of the bucket holding the t_pct percentile, in ms
+double hist_pct(const Histogram *t_hist, double t_pct)
+{
+    if (!t_hist->count)
+        return 0;
+    long l_rank = (long)(t_hist->count * t_pct / 100.0 + 0.5);
+    long l_seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        l_seen += t_hist->buckets[i];
+        if (l_seen >= l_rank && t_hist->buckets[i])
+            return std::min(hist_value(i + 1) - 1, t_hist->max) / 1000.0;
+    }
+    return t_hist->max / 1000.0;
+}
+
+double hist_mean(const Histogram *t_hist)
+{
+    return t_hist->count ? t_hist->sum / 1000.0 / t_hist->count : 0;
+}
+
+//***************************************************************************
+// load
+
+#define DEFAULT_CONNECTIONS     10
+#define DEFAULT_THREADS         2
+#define DEFAULT_DURATION        10      // seconds
+#define MAX_OUTSTANDING         64      // commands in flight on one connection
+#define DRAIN_MS                2000    // wait for answers after the run
+#define EPOLL_EVENTS            64
+
+enum ConnState
+{
+    C_CONNECTING,
+    C_HANDSHAKE,                        // waiting for '#0 pipeline <limit>'
+    C_READY,
+    C_CLOSED
+};
+
+struct Pending
+{
+    int mix;                            // index into g_mix
+    long due;                           // us, when the command should have been sent
+};
+
+struct Conn
+{
+    int sock;
+    ConnState state;
+    long started;                       // us, connect() called
+    long next_send;                     // us, next command is due
+    int next_id;                        // the server numbers commands from 1
+    std::string out;
+    size_t out_pos;
+    bool want_out;                      // EPOLLOUT registered
+    std::string in;
+    int out_id;                         // command of the output being skipped
+    long out_left;
+    std::unordered_map<int, Pending> pending;
+};
+
+struct LoadThread
+{
+    pthread_t thread;
+    int index;
+    int epfd;
+    int timer;
+    unsigned seed;
+    std::vector<Conn> conns;
+    Histogram connect;
+    std::vector<Histogram> commands;    // one for every mix entry
+    long sent;
+    long skipped;                       // due while MAX_OUTSTANDING were in flight
+    long connect_errors;
+    long io_errors;                     // lost connections and broken frames
+    long timeouts;                      // no answer within DRAIN_MS after the run
+};
+
+sockaddr_in g_addr;
+int g_connections = DEFAULT_CONNECTIONS;
+int g_threads = DEFAULT_THREADS;
+double g_rate = 0;                      // commands/s of all connections, 0 = closed loop
+long g_interval = 0;                    // us between commands of one connection
+long g_start;                           // us
+long g_end;                             // us, no new commands after it
+std::vector<std::string> g_mix;
+
+long now_us()
+{
+    timespec l_ts;
+    clock_gettime(CLOCK_MONOTONIC, &l_ts);
+    return l_ts.tv_sec * 1000000L + l_ts.tv_nsec / 1000;
+}
+
+void conn_events(LoadThread *t_thread, Conn *t_conn, bool t_out)
+{
+    epoll_event l_ev;
+    l_ev.events = EPOLLIN | (t_out ? EPOLLOUT : 0);
+    l_ev.data.ptr = t_conn;
+    epoll_ctl(t_thread->epfd, EPOLL_CTL_MOD, t_conn->sock, &l_ev);
+    t_conn->want_out = t_out;
+}
+
+void conn_close(LoadThread *t_thread, Conn *t_conn, bool t_error)
+{
+    if (t_conn->state == C_CLOSED)
+        return;
+    if (t_error)
+    {
+        t_thread->io_errors++;
+        for (auto &l_item : t_conn->pending)
+            t_thread->commands[l_item.second.mix].failed++;
+    }
+    t_conn->pending.clear();
+    close(t_conn->sock);
+    t_conn->state = C_CLOSED;
+}
+
+void conn_flush(LoadThread *t_thread, Conn *t_conn)
+{
+    while (t_conn->out_pos < t_conn->out.size())
+    {
+        ssize_t l_len = send(t_conn->sock, t_conn->out.data() + t_conn->out_pos,
+                             t_conn->out.size() - t_conn->out_pos, MSG_NOSIGNAL);
+        if (l_len < 0 && errno == EINTR)
+            continue;
+        if (l_len < 0 && errno == EAGAIN)
+            break;
+        if (l_len < 0)
+        {
+            log_msg(LOG_DEBUG, "Unable to send data to server.");
+            conn_close(t_thread, t_conn, true);
+            return;
+        }
+        t_conn->out_pos += l_len;
+    }
+    if (t_conn->out_pos == t_conn->out.size())
+    {
+        t_conn->out.clear();
+        t_conn->out_pos = 0;
+    }
+    bool l_want = t_conn->out_pos < t_conn->out.size() || t_conn->state == C_CONNECTING;
+    if (l_want != t_conn->want_out)
+        conn_events(t_thread, t_conn, l_want);
+}
+
+void conn_start(LoadThread *t_thread, Conn *t_conn)
+{
+    t_conn->state = C_CONNECTING;
+    t_conn->next_id = 0;
+    t_conn->out_pos = 0;
+    t_conn->out_left = 0;
+    t_conn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t_conn->sock < 0)
+    {
+        log_msg(LOG_ERROR, "Unable to create socket.");
+        t_thread->connect_errors++;
+        t_conn->state = C_CLOSED;
+        return;
+    }
+
+    t_conn->started = now_us();
+    if (connect(t_conn->sock, (sockaddr *)&g_addr, sizeof(g_addr)) < 0 && errno != EINPROGRESS)
+    {
+        log_msg(LOG_DEBUG, "Unable to connect server: %s", strerror(errno));
+        t_thread->connect_errors++;
+        close(t_conn->sock);
+        t_conn->state = C_CLOSED;
+        return;
+    }
+
+    // completion of connect() shows as writable socket
+    epoll_event l_ev;
+    l_ev.events = EPOLLIN | EPOLLOUT;
+    l_ev.data.ptr = t_conn;
+    epoll_ctl(t_thread->epfd, EPOLL_CTL_ADD, t_conn->sock, &l_ev);
+    t_conn->want_out = true;
+}
+
+void conn_connected(LoadThread *t_thread, Conn *t_conn)
+{
+    int l_err = 0;
+    socklen_t l_len = sizeof(l_err);
+    getsockopt(t_conn->sock, SOL_SOCKET, SO_ERROR, &l_err, &l_len);
+    if (l_err)
+    {
+        log_msg(LOG_DEBUG, "Unable to connect server: %s", strerror(l_err));
+        t_thread->connect_errors++;
+        close(t_conn->sock);
+        t_conn->state = C_CLOSED;
+        return;
+    }
+
+    hist_add(&t_thread->connect, now_us() - t_conn->started);
+    t_conn->state = C_HANDSHAKE;
+    t_conn->out = STR_PIPELINE "\n";
+    conn_flush(t_thread, t_conn);
+}
+
+// Queues one command of the mix
+void conn_command(LoadThread *t_thread, Conn *t_conn, long t_due)
+{
+    int l_mix = rand_r(&t_thread->seed) % g_mix.size();
+    int l_id = ++t_conn->next_id;
+    t_conn->pending[l_id] = {l_mix, t_due};
+    t_conn->out += g_mix[l_mix];
+    t_conn->out += '\n';
+    t_thread->sent++;
+}
+
+// Sends what is due, returns the time of the next command of the connection,
+// LONG_MAX if the connection waits only for the server
+long conn_schedule(LoadThread *t_thread, Conn *t_conn, long t_now)
+{
+    if (t_conn->state != C_READY || t_now >= g_end)
+        return LONG_MAX;
+
+    if (!g_interval)
+    {
+        // closed loop, the next command goes when the last one is done
+        if (t_conn->pending.empty())
+            conn_command(t_thread, t_conn, t_now);
+    }
+    else
+    {
+        while (t_conn->next_send <= t_now && t_conn->next_send < g_end)
+        {
+            if (t_conn->pending.size() >= MAX_OUTSTANDING)
+                t_thread->skipped++;
+            else
+                conn_command(t_thread, t_conn, t_conn->next_send);
+            t_conn->next_send += g_interval;
+        }
+    }
+    conn_flush(t_thread, t_conn);
+    return g_interval && t_conn->next_send < g_end ? t_conn->next_send : LONG_MAX;
+}
+
+// Consumes complete frames, false on a broken one
+bool conn_frames(LoadThread *t_thread, Conn *t_conn)
+{
+    std::string &l_in = t_conn->in;
+    size_t l_pos = 0;
+    while (l_pos < l_in.size())
+    {
+        if (t_conn->out_left > 0)
+        {
+            long l_take = std::min(t_conn->out_left, (long)(l_in.size() - l_pos));
+            t_conn->out_left -= l_take;
+            l_pos += l_take;
+            continue;
+        }
+
+        size_t l_eol = l_in.find('\n', l_pos);
+        if (l_eol == std::string::npos)
+            break;
+
+        int l_id;
+        char l_kind[16];
+        long l_value;
+        int l_fields = sscanf(l_in.c_str() + l_pos, "#%d %15s %ld", &l_id, l_kind, &l_value);
+        l_pos = l_eol + 1;
+        if (l_fields != 3)
+            return false;
+
+        if (!strcmp(l_kind, "out"))
+        {
+            t_conn->out_id = l_id;
+            t_conn->out_left = l_value;
+        }
+        else if (!strcmp(l_kind, STR_PIPELINE) && t_conn->state == C_HANDSHAKE)
+        {
+            t_conn->state = C_READY;
+            // spread the connections over one interval
+            t_conn->next_send = now_us() + (g_interval ? rand_r(&t_thread->seed) % g_interval : 0);
+        }
+        else if (!strcmp(l_kind, "exit"))
+        {
+            auto l_item = t_conn->pending.find(l_id);
+            if (l_item == t_conn->pending.end())
+                continue;
+            Histogram *l_hist = &t_thread->commands[l_item->second.mix];
+            hist_add(l_hist, now_us() - l_item->second.due);
+            if (l_value)
+                l_hist->failed++;
+            t_conn->pending.erase(l_item);
+        }
+    }
+    l_in.erase(0, l_pos);
+    return true;
+}
+
+void conn_read(LoadThread *t_thread, Conn *t_conn)
+{
+    char l_buf[16384];
+    while (t_conn->state != C_CLOSED)
+    {
+        ssize_t l_len = read(t_conn->sock, l_buf, sizeof(l_buf));
+        if (l_len < 0 && errno == EINTR)
+            continue;
+        if (l_len < 0 && errno == EAGAIN)
+            return;
+        if (l_len <= 0)
+        {
+            log_msg(LOG_DEBUG, "Server closed connection.");
+            conn_close(t_thread, t_conn, true);
+            return;
+        }
+
+        t_conn->in.append(l_buf, l_len);
+        if (t_conn->state == C_HANDSHAKE && t_conn->in[0] != '#')
+        {
+            log_msg(LOG_INFO, "Server does not support '%s'.", STR_PIPELINE);
+            conn_close(t_thread, t_conn, true);
+            return;
+        }
+        if (!conn_frames(t_thread, t_conn))
+        {
+            log_msg(LOG_DEBUG, "Broken frame from server.");
+            conn_close(t_thread, t_conn, true);
+            return;
+        }
+        if (!g_interval)
+            conn_schedule(t_thread, t_conn, now_us());
+    }
+}
+
+void *load_thread(void *t_arg)
+{
+    LoadThread *l_thread = (LoadThread *)t_arg;
+    l_thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+    l_thread->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    epoll_event l_ev;
+    l_ev.events = EPOLLIN;
+    l_ev.data.ptr = NULL;               // NULL is the timer
+    epoll_ctl(l_thread->epfd, EPOLL_CTL_ADD, l_thread->timer, &l_ev);
+
+    for (Conn &l_conn : l_thread->conns)
+        conn_start(l_thread, &l_conn);
+
+    epoll_event l_events[EPOLL_EVENTS];
+    while (1)
+    {
+        long l_now = now_us();
+        long l_wake = l_now < g_end ? g_end : g_end + DRAIN_MS * 1000L;
+        bool l_busy = false;
+        for (Conn &l_conn : l_thread->conns)
+        {
+            if (l_conn.state == C_CLOSED)
+                continue;
+            l_wake = std::min(l_wake, conn_schedule(l_thread, &l_conn, l_now));
+            if (l_conn.state != C_READY || !l_conn.pending.empty())
+                l_busy = true;
+        }
+        if (l_now >= g_end + DRAIN_MS * 1000L || (l_now >= g_end && !l_busy))
+            break;
+        if (l_wake <= l_now)
+            l_wake = l_now + 1;
+
+        itimerspec l_its = {};
+        l_its.it_value.tv_sec = l_wake / 1000000;
+        l_its.it_value.tv_nsec = l_wake % 1000000 * 1000;
+        timerfd_settime(l_thread->timer, TFD_TIMER_ABSTIME, &l_its, NULL);
+
+        int l_count = epoll_wait(l_thread->epfd, l_events, EPOLL_EVENTS, -1);
+        for (int i = 0; i < l_count; i++)
+        {
+            Conn *l_conn = (Conn *)l_events[i].data.ptr;
+            if (!l_conn)
+            {
+                uint64_t l_ticks;
+                read(l_thread->timer, &l_ticks, sizeof(l_ticks));
+                continue;
+            }
+            if (l_conn->state == C_CLOSED)
+                continue;
+            if (l_conn->state == C_CONNECTING)
+            {
+                conn_connected(l_thread, l_conn);
+                continue;
+            }
+            if (l_events[i].events & EPOLLOUT)
+                conn_flush(l_thread, l_conn);
+            if (l_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                conn_read(l_thread, l_conn);
+        }
+    }
+
+    for (Conn &l_conn : l_thread->conns)
+    {
+        if (l_conn.state == C_CONNECTING || l_conn.state == C_HANDSHAKE)
+            l_thread->connect_errors++;
+        l_thread->timeouts += l_conn.pending.size();
+        for (auto &l_item : l_conn.pending)
+            l_thread->commands[l_item.second.mix].failed++;
+        l_conn.pending.clear();
+        if (l_conn.state != C_CLOSED)
+            close(l_conn.sock);
+        l_conn.state = C_CLOSED;
+    }
+    close(l_thread->timer);
+    close(l_thread->epfd);
+    return NULL;
+}
+
+//***************************************************************************
+// results
+
+// Command names are quoted for CSV and JSON the same way
+std::string quoted(const std::string &t_str, bool t_json)
+{
+    std::string l_out = "\"";
+    for (char l_c : t_str)
+    {
+        if (l_c == '"')
+            l_out += t_json ? "\\\"" : "\"\"";
+        else if (l_c == '\\' && t_json)
+            l_out += "\\\\";
+        else if ((unsigned char)l_c < ' ')
+            l_out += ' ';
+        else
+            l_out += l_c;
+    }
+    return l_out + "\"";
+}
+
+void print_stats_json(FILE *t_out, const char *t_name, const Histogram *t_hist, bool t_buckets)
+{
+    fprintf(t_out, "{\"name\": %s, \"count\": %ld, \"failed\": %ld, \"mean_ms\": %.3f, "
+                   "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+            quoted(t_name, true).c_str(), t_hist->count, t_hist->failed, hist_mean(t_hist),
+            hist_pct(t_hist, 50), hist_pct(t_hist, 90), hist_pct(t_hist, 99), t_hist->max / 1000.0);
+    if (t_buckets)
+    {
+        // [lowest value in ms, count] of the non-empty buckets
+        fprintf(t_out, ", \"histogram\": [");
+        const char *l_sep = "";
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            if (!t_hist->buckets[i])
+                continue;
+            fprintf(t_out, "%s[%.3f, %ld]", l_sep, hist_value(i) / 1000.0, t_hist->buckets[i]);
+            l_sep = ", ";
+        }
+        fprintf(t_out, "]");
+    }
+    fprintf(t_out, "}");
+}
+
+void print_results(FILE *t_out, bool t_json, LoadThread *t_total, double t_seconds)
+{
+    Histogram l_all = {};
+    for (const Histogram &l_hist : t_total->commands)
+        hist_merge(&l_all, &l_hist);
+    double l_achieved = t_seconds > 0 ? l_all.count / t_seconds : 0;
+
+    if (t_json)
+    {
+        fprintf(t_out, "{\n  \"connections\": %d,\n  \"threads\": %d,\n  \"target_rate\": %.1f,\n"
+                       "  \"duration_s\": %.3f,\n  \"achieved_rate\": %.1f,\n  \"sent\": %ld,\n"
+                       "  \"skipped\": %ld,\n  \"timeouts\": %ld,\n  \"connect_errors\": %ld,\n"
+                       "  \"io_errors\": %ld,\n  \"connect\": ",
+                g_connections, g_threads, g_rate, t_seconds, l_achieved, t_total->sent,
+                t_total->skipped, t_total->timeouts, t_total->connect_errors, t_total->io_errors);
+        print_stats_json(t_out, "connect", &t_total->connect, true);
+        fprintf(t_out, ",\n  \"all\": ");
+        print_stats_json(t_out, "all", &l_all, true);
+        fprintf(t_out, ",\n  \"commands\": [");
+        for (size_t i = 0; i < g_mix.size(); i++)
+        {
+            fprintf(t_out, "%s\n    ", i ? "," : "");
+            print_stats_json(t_out, g_mix[i].c_str(), &t_total->commands[i], true);
+        }
+        fprintf(t_out, "\n  ]\n}\n");
+        return;
+    }
+
+    // one row per command and one for all, every row carries the whole run
+    fprintf(t_out, "connections,threads,target_rate,achieved_rate,sent,skipped,timeouts,"
+                   "connect_errors,io_errors,connect_p50_ms,connect_p99_ms,connect_max_ms,"
+                   "command,count,failed,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n");
+    for (size_t i = 0; i <= g_mix.size(); i++)
+    {
+        const Histogram *l_hist = i < g_mix.size() ? &t_total->commands[i] : &l_all;
+        std::string l_name = i < g_mix.size() ? g_mix[i] : "all";
+        fprintf(t_out, "%d,%d,%.1f,%.1f,%ld,%ld,%ld,%ld,%ld,%.3f,%.3f,%.3f,%s,%ld,%ld,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                g_connections, g_threads, g_rate, l_achieved, t_total->sent, t_total->skipped,
+                t_total->timeouts, t_total->connect_errors, t_total->io_errors,
+                hist_pct(&t_total->connect, 50), hist_pct(&t_total->connect, 99),
+                t_total->connect.max / 1000.0, quoted(l_name, false).c_str(),
+                l_hist->count, l_hist->failed, hist_mean(l_hist),
+                hist_pct(l_hist, 50), hist_pct(l_hist, 90), hist_pct(l_hist, 99), l_hist->max / 1000.0);
+    }
+}
+
+//***************************************************************************
+// help
+
+void help(char **t_args)
+{
+    printf(
+        "\n"
+        "  Load generator for the socket server.\n"
+        "\n"
+        "  Use: %s [-h -d -j -c connections -t threads -r rate -n seconds -m mix_file] ip_or_name port_number [out_file]\n"
+        "\n"
+        "    -d  debug mode \n"
+        "    -j  results as JSON instead of CSV\n"
+        "    -c  connections (default %d)\n"
+        "    -t  threads, each with its own epoll set (default %d)\n"
+        "    -r  commands/s of all connections, 0 = each connection sends\n"
+        "        the next command when the last one is done (default 0)\n"
+        "    -n  duration in seconds (default %d)\n"
+        "    -m  file with commands, one per line, repeat a line to give it weight\n"
+        "    -h  this help\n"
+        "\n"
+        "  Latency is measured from the time a command was due, so a slow server\n"
+        "  can not hide its delay by slowing the generator down.\n"
+        "\n",
+        t_args[0], DEFAULT_CONNECTIONS, DEFAULT_THREADS, DEFAULT_DURATION);
+    exit(0);
+}
+
+bool load_mix(const char *t_name)
+{
+    FILE *l_file = fopen(t_name, "r");
+    if (!l_file)
+        return false;
+
+    char *l_line = NULL;
+    size_t l_size = 0;
+    ssize_t l_len;
+    while ((l_len = getline(&l_line, &l_size, l_file)) >= 0)
+    {
+        while (l_len > 0 && (l_line[l_len - 1] == '\n' || l_line[l_len - 1] == '\r'))
+            l_line[--l_len] = '\0';
+        if (strspn(l_line, " \t") == (size_t)l_len || !strncasecmp(l_line, STR_CLOSE, strlen(STR_CLOSE)))
+            continue;
+        g_mix.push_back(l_line);
+    }
+    free(l_line);
+    fclose(l_file);
+    return true;
+}
+
+//***************************************************************************
+
+int main(int t_narg, char **t_args)
+{
+    if (t_narg <= 2)
+        help(t_args);
+
+    int l_port = 0;
+    char *l_host = NULL;
+    char *l_out_name = NULL;
+    bool l_json = false;
+    int l_duration = DEFAULT_DURATION;
+
+    // parsing arguments
+    for (int i = 1; i < t_narg; i++)
+    {
+        if (!strcmp(t_args[i], "-d"))
+            g_debug = LOG_DEBUG;
+
+        else if (!strcmp(t_args[i], "-h"))
+            help(t_args);
+
+        else if (!strcmp(t_args[i], "-j"))
+            l_json = true;
+
+        else if (!strcmp(t_args[i], "-c") && i + 1 < t_narg)
+            g_connections = atoi(t_args[++i]);
+
+        else if (!strcmp(t_args[i], "-t") && i + 1 < t_narg)
+            g_threads = atoi(t_args[++i]);
+
+        else if (!strcmp(t_args[i], "-r") && i + 1 < t_narg)
+            g_rate = atof(t_args[++i]);
+
+        else if (!strcmp(t_args[i], "-n") && i + 1 < t_narg)
+            l_duration = atoi(t_args[++i]);
+
+        else if (!strcmp(t_args[i], "-m") && i + 1 < t_narg)
+        {
+            if (!load_mix(t_args[++i]))
+            {
+                log_msg(LOG_ERROR, "Unable to read command mix '%s'.", t_args[i]);
+                exit(1);
+            }
+        }
+
+        else if (*t_args[i] != '-')
+        {
+            if (!l_host)
+                l_host = t_args[i];
+            else if (!l_port)
+                l_port = atoi(t_args[i]);
+            else if (!l_out_name)
+                l_out_name = t_args[i];
+        }
+    }
+
+    if (!l_host || !l_port)
+    {
+        log_msg(LOG_INFO, "Host or port is missing!");
+        exit(1);
+    }
+    if (g_connections <= 0 || g_threads <= 0 || g_rate < 0 || l_duration <= 0)
+    {
+        log_msg(LOG_INFO, "Bad number of connections, threads, rate or duration!");
+        exit(1);
+    }
+    if (g_mix.empty())
+    {
+        g_mix.push_back("date");
+        g_mix.push_back("echo hello");
+        g_mix.push_back("ls /");
+    }
+    g_threads = std::min(g_threads, g_connections);
+    if (g_rate > 0)
+        g_interval = std::max(1L, (long)(g_connections * 1e6 / g_rate));
+
+    FILE *l_out = stdout;
+    if (l_out_name && !(l_out = fopen(l_out_name, "w")))
+    {
+        log_msg(LOG_ERROR, "Unable to open '%s'.", l_out_name);
+        exit(1);
+    }
+
+    addrinfo l_ai_req, *l_ai_ans;
+    bzero(&l_ai_req, sizeof(l_ai_req));
+    l_ai_req.ai_family = AF_INET;
+    l_ai_req.ai_socktype = SOCK_STREAM;
+
+    int l_get_ai = getaddrinfo(l_host, NULL, &l_ai_req, &l_ai_ans);
+    if (l_get_ai)
+    {
+        log_msg(LOG_ERROR, "Unknown host name!");
+        exit(1);
+    }
+
+    g_addr = *(sockaddr_in *)l_ai_ans->ai_addr;
+    g_addr.sin_port = htons(l_port);
+    freeaddrinfo(l_ai_ans);
+
+    log_msg(LOG_INFO, "%d connections to '%s':%d from %d threads for %d s, %d commands in mix.",
+            g_connections, l_host, l_port, g_threads, l_duration, (int)g_mix.size());
+
+    std::vector<LoadThread> l_threads(g_threads);
+    for (int i = 0; i < g_threads; i++)
+    {
+        LoadThread &l_thread = l_threads[i];
+        l_thread.index = i;
+        l_thread.seed = i + 1;
+        l_thread.conns.resize(g_connections / g_threads + (i < g_connections % g_threads));
+        l_thread.connect = Histogram();
+        l_thread.commands.assign(g_mix.size(), Histogram());
+        l_thread.sent = l_thread.skipped = l_thread.connect_errors = 0;
+        l_thread.io_errors = l_thread.timeouts = 0;
+    }
+
+    g_start = now_us();
+    g_end = g_start + l_duration * 1000000L;
+    for (LoadThread &l_thread : l_threads)
+    {
+        if (pthread_create(&l_thread.thread, NULL, load_thread, &l_thread))
+        {
+            log_msg(LOG_ERROR, "Unable to create thread.");
+            exit(1);
+        }
+    }
+
+    LoadThread l_total;
+    l_total.connect = Histogram();
+    l_total.commands.assign(g_mix.size(), Histogram());
+    l_total.sent = l_total.skipped = l_total.connect_errors = 0;
+    l_total.io_errors = l_total.timeouts = 0;
+    for (LoadThread &l_thread : l_threads)
+    {
+        pthread_join(l_thread.thread, NULL);
+        hist_merge(&l_total.connect, &l_thread.connect);
+        for (size_t i = 0; i < g_mix.size(); i++)
+            hist_merge(&l_total.commands[i], &l_thread.commands[i]);
+        l_total.sent += l_thread.sent;
+        l_total.skipped += l_thread.skipped;
+        l_total.connect_errors += l_thread.connect_errors;
+        l_total.io_errors += l_thread.io_errors;
+        l_total.timeouts += l_thread.timeouts;
+    }
+
+    double l_seconds = (std::min(now_us(), g_end) - g_start) / 1e6;
+    log_msg(LOG_INFO, "%ld commands sent, %ld connections failed, %ld connections lost.",
+            l_total.sent, l_total.connect_errors, l_total.io_errors);
+    print_results(l_out, l_json, &l_total, l_seconds);
+
+    if (l_out != stdout)
+        fclose(l_out);
+    return 0;
+}
@@ -7,7 +7,9 @@
 // Modified Socket Server.
 //
 // This server can handle multiple clients simultaneously.
-// For each connected client, it forks a new process.
+// For each connected client, it forks a new process, or with -p it hands
+// the client to one of the pre-forked handler processes. With -e a single
+// process serves all clients from an epoll event loop.
 // Each received line from the client is treated as a command to execute.
 //
 //***************************************************************************
@@ -24,12 +26,28 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h> // Added for wait
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 #define STR_CLOSE   "close"
 #define STR_QUIT    "quit"
+#define STR_PIPELINE "pipeline"
+#define STR_CACHE   "cache"
+#define STR_STATS   "stats"
 
 //***************************************************************************
 // log messages
@@ -41,6 +59,23 @@
 // debug flag
 int g_debug = LOG_INFO;
 
+//***************************************************************************
+// pre-forked pool of client handlers
+
+#define POOL_GROWTH             4       // default upper bound is POOL_GROWTH * pool size
+
+// State shared by the server and all handler processes
+struct PoolState
+{
+    pthread_mutex_t accept_lock;        // one handler at a time waits in accept()
+    int idle;                           // handlers waiting for a client
+};
+
+int g_pool_size = 0;                    // handlers kept ready, 0 = fork per client
+int g_pool_max = 0;                     // upper bound of handler processes
+PoolState *g_pool = NULL;
+int g_pool_notify[2];                   // handlers and SIGCHLD wake the server up
+
 void log_msg(int t_log_level, const char *t_form, ...)
 {
     const char *out_fmt[] = {
@@ -48,112 +83,1503 @@ void log_msg(int t_log_level, const char *t_form, ...)
         "INF: %s\n",
         "DEB: %s\n"};
 
-    if (t_log_level && t_log_level > g_debug)
+    if (t_log_level && t_log_level > g_debug)
+        return;
+
+    char l_buf[1024];
+    va_list l_arg;
+    va_start(l_arg, t_form);
+    vsnprintf(l_buf, sizeof(l_buf), t_form, l_arg);
+    va_end(l_arg);
+
+    switch (t_log_level)
+    {
+    case LOG_INFO:
+    case LOG_DEBUG:
+        fprintf(stdout, out_fmt[t_log_level], l_buf);
+        break;
+
+    case LOG_ERROR:
+        fprintf(stderr, out_fmt[t_log_level], errno, strerror(errno), l_buf);
+        break;
+    }
+}
+
+//***************************************************************************
+// command launcher
+
+// Limits of every command, 0 = inherited from the server
+long g_limit_cpu = 0;                   // seconds of CPU time
+long g_limit_as = 0;                    // MiB of address space
+long g_limit_files = 0;                 // open file descriptors
+char *g_cgroup_procs = NULL;            // cgroup.procs file of cgroup v2 for commands
+
+// Runs in the child between fork() and exec()
+int apply_limits()
+{
+    rlimit l_limit;
+    if (g_limit_cpu)
+    {
+        // SIGXCPU at the soft limit, SIGKILL one second later
+        l_limit.rlim_cur = g_limit_cpu;
+        l_limit.rlim_max = g_limit_cpu + 1;
+        if (setrlimit(RLIMIT_CPU, &l_limit) < 0)
+            return -1;
+    }
+    if (g_limit_as)
+    {
+        l_limit.rlim_cur = l_limit.rlim_max = (rlim_t)g_limit_as * 1024 * 1024;
+        if (setrlimit(RLIMIT_AS, &l_limit) < 0)
+            return -1;
+    }
+    if (g_limit_files)
+    {
+        l_limit.rlim_cur = l_limit.rlim_max = g_limit_files;
+        if (setrlimit(RLIMIT_NOFILE, &l_limit) < 0)
+            return -1;
+    }
+    if (g_cgroup_procs)
+    {
+        int l_fd = open(g_cgroup_procs, O_WRONLY | O_CLOEXEC);
+        if (l_fd < 0)
+            return -1;
+        char l_pid[32];
+        int l_len = snprintf(l_pid, sizeof(l_pid), "%d\n", getpid());
+        int l_ret = write(l_fd, l_pid, l_len);
+        close(l_fd);
+        if (l_ret != l_len)
+            return -1;
+    }
+    return 0;
+}
+
+// posix_spawn() can not set limits, so limited commands use fork().
+// A close-on-exec pipe tells the server whether exec() succeeded.
+pid_t spawn_limited(char **t_args, int t_fd_out)
+{
+    int l_status[2];
+    if (pipe2(l_status, O_CLOEXEC) < 0)
+        return -1;
+
+    pid_t l_pid = fork();
+    if (l_pid == 0)
+    {
+        close(l_status[0]);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(t_fd_out, STDOUT_FILENO);
+        dup2(t_fd_out, STDERR_FILENO);
+        close(t_fd_out);
+        if (apply_limits() == 0)
+            execvp(t_args[0], t_args);
+        int l_err = errno;
+        write(l_status[1], &l_err, sizeof(l_err));
+        _exit(127);
+    }
+    close(l_status[1]);
+    if (l_pid < 0)
+    {
+        close(l_status[0]);
+        return -1;
+    }
+
+    int l_err;
+    ssize_t l_len;
+    do
+        l_len = read(l_status[0], &l_err, sizeof(l_err));
+    while (l_len < 0 && errno == EINTR);
+    close(l_status[0]);
+
+    if (l_len == sizeof(l_err))
+    {
+        waitpid(l_pid, NULL, 0);
+        errno = l_err;
+        return -1;
+    }
+    return l_pid;
+}
+
+// Starts the command with stdout and stderr redirected to t_fd_out.
+// posix_spawn() is vfork based, so the page tables of the server are not copied.
+// Returns pid of the command, or -1 with errno set.
+pid_t spawn_command(char **t_args, int t_fd_out)
+{
+    if (g_limit_cpu || g_limit_as || g_limit_files || g_cgroup_procs)
+        return spawn_limited(t_args, t_fd_out);
+
+    posix_spawn_file_actions_t l_actions;
+    posix_spawn_file_actions_init(&l_actions);
+    posix_spawn_file_actions_adddup2(&l_actions, t_fd_out, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&l_actions, t_fd_out, STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&l_actions, t_fd_out);
+
+    // the server ignores SIGPIPE, commands get the default back
+    posix_spawnattr_t l_attr;
+    posix_spawnattr_init(&l_attr);
+    sigset_t l_default;
+    sigemptyset(&l_default);
+    sigaddset(&l_default, SIGPIPE);
+    posix_spawnattr_setsigdefault(&l_attr, &l_default);
+    posix_spawnattr_setflags(&l_attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t l_pid;
+    int l_err = posix_spawnp(&l_pid, t_args[0], &l_actions, &l_attr, t_args, environ);
+    posix_spawn_file_actions_destroy(&l_actions);
+    posix_spawnattr_destroy(&l_attr);
+
+    if (l_err)
+    {
+        errno = l_err;
+        return -1;
+    }
+    return l_pid;
+}
+
+//***************************************************************************
+// helpers
+
+void log_client(int l_sock_client)
+{
+    sockaddr_in l_addr;
+    socklen_t l_lsa = sizeof(l_addr);
+    // my IP
+    getsockname(l_sock_client, (sockaddr *)&l_addr, &l_lsa);
+    log_msg(LOG_INFO, "My IP: '%s'  port: %d",
+            inet_ntoa(l_addr.sin_addr), ntohs(l_addr.sin_port));
+    // client IP
+    getpeername(l_sock_client, (sockaddr *)&l_addr, &l_lsa);
+    log_msg(LOG_INFO, "Client IP: '%s'  port: %d",
+            inet_ntoa(l_addr.sin_addr), ntohs(l_addr.sin_port));
+}
+
+// Mutex in memory shared by the server processes, robust so that a process
+// killed while holding it does not block the others
+void shared_mutex_init(pthread_mutex_t *t_mutex)
+{
+    pthread_mutexattr_t l_attr;
+    pthread_mutexattr_init(&l_attr);
+    pthread_mutexattr_setpshared(&l_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&l_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(t_mutex, &l_attr);
+    pthread_mutexattr_destroy(&l_attr);
+}
+
+void shared_lock(pthread_mutex_t *t_mutex)
+{
+    if (pthread_mutex_lock(t_mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(t_mutex);
+}
+
+// Anonymous memory that stays shared with the processes forked later
+void *shared_alloc(size_t t_size)
+{
+    void *l_mem = mmap(NULL, t_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (l_mem == MAP_FAILED)
+    {
+        log_msg(LOG_ERROR, "Unable to map shared memory.");
+        exit(1);
+    }
+    return l_mem;
+}
+
+long now_us()
+{
+    timespec l_ts;
+    clock_gettime(CLOCK_MONOTONIC, &l_ts);
+    return l_ts.tv_sec * 1000000L + l_ts.tv_nsec / 1000;
+}
+
+long now_ms()
+{
+    return now_us() / 1000;
+}
+
+void print_cache_stats();
+std::string stats_summary();
+
+// Reads a line from stdin, returns true if it is the request to quit
+bool read_quit()
+{
+    char buf[128];
+    int len = read(STDIN_FILENO, buf, sizeof(buf) - 1);
+    if (len < 0)
+    {
+        log_msg(LOG_DEBUG, "Unable to read from stdin!");
+        exit(1);
+    }
+
+    buf[len] = '\0'; // Null-terminate the string
+    log_msg(LOG_DEBUG, "Read %d bytes from stdin: %s", len, buf);
+    if (!strncmp(buf, STR_CACHE, strlen(STR_CACHE)))
+        print_cache_stats();
+    if (!strncmp(buf, STR_STATS, strlen(STR_STATS)))
+        fputs(stats_summary().c_str(), stdout);
+    // request to quit?
+    return !strncmp(buf, STR_QUIT, strlen(STR_QUIT));
+}
+
+//***************************************************************************
+// line framing
+//
+// Bytes from the client are collected in a ring buffer and cut into lines,
+// so several commands in one packet and one command split into several
+// packets both work. The buffer grows up to LINE_MAX_LEN, longer lines are
+// dropped and reported.
+
+#define LINE_BUF_INIT           4096    // initial ring size, power of two
+#define LINE_MAX_LEN            65536   // longest accepted command line
+
+#define STR_LINE_TOO_LONG       "Error: Command line too long\n"
+#define STR_EXEC_FAILED         "Error: Command execution failed\n"
+
+struct LineReader
+{
+    std::vector<char> buf;              // ring, size is a power of two
+    size_t head;                        // first byte of the current line
+    size_t tail;                        // end of received data
+    size_t scan;                        // bytes up to here contain no '\n'
+    bool discard;                       // skipping the rest of a too long line
+};
+
+void line_init(LineReader *t_reader)
+{
+    t_reader->buf.resize(LINE_BUF_INIT);
+    t_reader->head = t_reader->tail = t_reader->scan = 0;
+    t_reader->discard = false;
+}
+
+// Doubles the ring, data keeps its logical positions
+void line_grow(LineReader *t_reader)
+{
+    size_t l_size = t_reader->buf.size();
+    std::vector<char> l_new(l_size * 2);
+    for (size_t i = t_reader->head; i < t_reader->tail; i++)
+        l_new[i & (l_size * 2 - 1)] = t_reader->buf[i & (l_size - 1)];
+    t_reader->buf.swap(l_new);
+}
+
+// Reads what the socket has into the free part of the ring with one readv().
+// Returns the result of readv(), 0 means the client closed its side.
+int line_fill(LineReader *t_reader, int t_fd)
+{
+    size_t l_size = t_reader->buf.size();
+    if (t_reader->tail - t_reader->head == l_size)
+    {
+        if (l_size < LINE_MAX_LEN)
+            line_grow(t_reader);
+        else
+        {
+            // full ring without '\n', keep only the tail to find the line end
+            t_reader->discard = true;
+            t_reader->head = t_reader->scan = t_reader->tail;
+        }
+        l_size = t_reader->buf.size();
+    }
+
+    size_t l_mask = l_size - 1;
+    size_t l_free = l_size - (t_reader->tail - t_reader->head);
+    size_t l_pos = t_reader->tail & l_mask;
+    iovec l_iov[2];
+    l_iov[0].iov_base = &t_reader->buf[l_pos];
+    l_iov[0].iov_len = MIN(l_free, l_size - l_pos);
+    l_iov[1].iov_base = &t_reader->buf[0];
+    l_iov[1].iov_len = l_free - l_iov[0].iov_len;
+
+    int l_len = readv(t_fd, l_iov, l_iov[1].iov_len ? 2 : 1);
+    if (l_len > 0)
+        t_reader->tail += l_len;
+    return l_len;
+}
+
+// Takes the next complete line out of the ring, without '\n' or '\r\n'.
+// At EOF the unterminated rest counts as a line too.
+// Returns 1 for a line, 0 if more data is needed, -1 for a dropped too long line.
+int line_next(LineReader *t_reader, std::string &t_line, bool t_eof)
+{
+    size_t l_mask = t_reader->buf.size() - 1;
+    size_t l_end = t_reader->scan;
+    while (l_end < t_reader->tail && t_reader->buf[l_end & l_mask] != '\n')
+        l_end++;
+
+    if (l_end == t_reader->tail && !(t_eof && l_end > t_reader->head))
+    {
+        t_reader->scan = l_end;
+        return 0;
+    }
+
+    bool l_dropped = t_reader->discard || l_end - t_reader->head > LINE_MAX_LEN;
+    t_line.clear();
+    if (!l_dropped)
+    {
+        for (size_t i = t_reader->head; i < l_end; i++)
+            t_line += t_reader->buf[i & l_mask];
+        if (!t_line.empty() && t_line.back() == '\r')
+            t_line.pop_back();
+    }
+
+    t_reader->head = t_reader->scan = MIN(l_end + 1, t_reader->tail);
+    t_reader->discard = false;
+    return l_dropped ? -1 : 1;
+}
+
+// Splits the line in place into arguments. Blanks separate arguments,
+// '...' and "..." group words and a backslash escapes the next character.
+// Returns the number of arguments, t_args is NULL terminated.
+int split_args(std::string &t_line, std::vector<char *> &t_args)
+{
+    t_args.clear();
+    char *l_in = &t_line[0];
+    char *l_out = l_in;
+
+    while (*l_in)
+    {
+        while (*l_in == ' ' || *l_in == '\t')
+            l_in++;
+        if (!*l_in)
+            break;
+
+        t_args.push_back(l_out);
+        char l_quote = 0;
+        while (*l_in && (l_quote || (*l_in != ' ' && *l_in != '\t')))
+        {
+            if (l_quote && *l_in == l_quote)
+                l_quote = 0;
+            else if (!l_quote && (*l_in == '\'' || *l_in == '"'))
+                l_quote = *l_in;
+            else if (*l_in == '\\' && l_quote != '\'' && l_in[1])
+                *l_out++ = *++l_in;
+            else
+                *l_out++ = *l_in;
+            l_in++;
+        }
+        if (*l_in)
+            l_in++;
+        *l_out++ = '\0';
+    }
+
+    int l_argc = t_args.size();
+    t_args.push_back(NULL);
+    return l_argc;
+}
+
+// True when the line is the builtin word, in any case, alone or followed by blanks
+bool is_builtin(const std::string &t_line, const char *t_word)
+{
+    size_t l_len = strlen(t_word);
+    if (strncasecmp(t_line.c_str(), t_word, l_len))
+        return false;
+    char l_next = t_line.c_str()[l_len];
+    return !l_next || l_next == ' ' || l_next == '\t';
+}
+
+//***************************************************************************
+// command accounting
+//
+// Every finished command adds its rusage from wait4() and wall time to the
+// row of its name. The table is in shared memory like the result cache, so
+// 'stats' shows the commands of all handler processes.
+
+#define STATS_NAMES             32      // rows, the rest goes to STATS_OTHER
+#define STATS_NAME_MAX          32
+#define STATS_OTHER             "(other)"
+
+struct CommandStats
+{
+    char name[STATS_NAME_MAX];
+    long runs;
+    long failed;                        // exit status other than 0
+    long user_us;
+    long sys_us;
+    long wall_us;
+    long max_rss;                       // KiB, largest of all runs
+};
+
+struct StatsTable
+{
+    pthread_mutex_t lock;
+    int used;
+    CommandStats total;
+    CommandStats other;
+    CommandStats rows[STATS_NAMES];
+};
+
+StatsTable *g_stats = NULL;
+
+void stats_init()
+{
+    g_stats = (StatsTable *)shared_alloc(sizeof(StatsTable));
+    shared_mutex_init(&g_stats->lock);
+    strcpy(g_stats->total.name, "total");
+    strcpy(g_stats->other.name, STATS_OTHER);
+}
+
+void stats_add(CommandStats *t_row, int t_status, const rusage *t_usage, long t_wall_us)
+{
+    t_row->runs++;
+    if (t_status)
+        t_row->failed++;
+    t_row->user_us += t_usage->ru_utime.tv_sec * 1000000L + t_usage->ru_utime.tv_usec;
+    t_row->sys_us += t_usage->ru_stime.tv_sec * 1000000L + t_usage->ru_stime.tv_usec;
+    t_row->wall_us += t_wall_us;
+    t_row->max_rss = std::max(t_row->max_rss, t_usage->ru_maxrss);
+}
+
+void stats_record(const char *t_name, int t_status, const rusage *t_usage, long t_wall_us)
+{
+    if (!g_stats)
+        return;
+
+    shared_lock(&g_stats->lock);
+    CommandStats *l_row = NULL;
+    for (int i = 0; i < g_stats->used && !l_row; i++)
+        if (!strncmp(g_stats->rows[i].name, t_name, STATS_NAME_MAX - 1))
+            l_row = &g_stats->rows[i];
+    if (!l_row && g_stats->used < STATS_NAMES)
+    {
+        l_row = &g_stats->rows[g_stats->used++];
+        snprintf(l_row->name, STATS_NAME_MAX, "%s", t_name);
+    }
+    if (!l_row)
+        l_row = &g_stats->other;
+
+    stats_add(l_row, t_status, t_usage, t_wall_us);
+    stats_add(&g_stats->total, t_status, t_usage, t_wall_us);
+    pthread_mutex_unlock(&g_stats->lock);
+}
+
+void stats_line(std::string &t_out, const CommandStats *t_row)
+{
+    char l_line[256];
+    snprintf(l_line, sizeof(l_line), "%-20s %8ld %8ld %10.3f %10.3f %10.3f %10ld\n",
+             t_row->name, t_row->runs, t_row->failed,
+             t_row->user_us / 1e6, t_row->sys_us / 1e6, t_row->wall_us / 1e6, t_row->max_rss);
+    t_out += l_line;
+}
+
+// Table of commands sorted by used CPU time, the most expensive first
+std::string stats_summary()
+{
+    std::string l_out;
+    char l_head[256];
+    snprintf(l_head, sizeof(l_head), "%-20s %8s %8s %10s %10s %10s %10s\n",
+             "command", "runs", "failed", "user s", "sys s", "wall s", "maxrss KiB");
+    l_out = l_head;
+    if (!g_stats)
+        return l_out;
+
+    shared_lock(&g_stats->lock);
+    std::vector<CommandStats> l_rows(g_stats->rows, g_stats->rows + g_stats->used);
+    CommandStats l_other = g_stats->other;
+    CommandStats l_total = g_stats->total;
+    pthread_mutex_unlock(&g_stats->lock);
+
+    std::sort(l_rows.begin(), l_rows.end(), [](const CommandStats &a, const CommandStats &b)
+              { return a.user_us + a.sys_us > b.user_us + b.sys_us; });
+    for (const CommandStats &l_row : l_rows)
+        stats_line(l_out, &l_row);
+    if (l_other.runs)
+        stats_line(l_out, &l_other);
+    stats_line(l_out, &l_total);
+    return l_out;
+}
+
+//***************************************************************************
+// pipelined commands
+//
+// After the client sends 'pipeline', every command gets an id (1, 2, ...)
+// and up to g_cmd_limit commands run at the same time. Their output is sent
+// back in frames, each with a text header:
+//
+//   #<id> out <len>\n<len bytes of output>
+//   #<id> exit <status>\n
+//
+// The switch is confirmed by '#0 pipeline <limit>\n'. Exit status 127 means
+// the command could not be started, 128 + N that it was killed by signal N.
+
+#define DEFAULT_CMD_LIMIT       8       // commands running at once per client
+#define FRAME_CHUNK             4096    // max. output bytes in one frame
+
+int g_cmd_limit = DEFAULT_CMD_LIMIT;
+
+int exit_status(int t_status)
+{
+    if (WIFSIGNALED(t_status))
+        return 128 + WTERMSIG(t_status);
+    return WEXITSTATUS(t_status);
+}
+
+//***************************************************************************
+// event loop
+//
+// With -e one server process owns all client sockets in an edge-triggered
+// epoll set. Commands are parsed in the server, only the commands themselves
+// run in new processes. Their output comes back through pipes that are in
+// the same epoll set, and a pidfd reports the exit of a command that closed
+// its output early. Without -e the same loop serves a single client inside
+// its handler process.
+
+#define EPOLL_EVENTS            64      // events taken by one epoll_wait()
+#define REAP_POLL_MS            20      // exits checked without a pidfd
+
+bool g_event_loop = false;
+
+//***************************************************************************
+// output capture
+//
+// Output of commands is read from pipes into a buffer of the session and
+// sent from there. When the buffer reaches the high watermark the server
+// stops reading the pipes, so commands block on their full pipe instead of
+// the server buffering without limit. Reading resumes below the low
+// watermark. With -z a plain session (one command, raw output) moves the
+// output from the pipe to the socket with splice() while its buffer is empty.
+
+#define DEFAULT_OUT_HIGH        (256 * 1024)    // pending output that pauses commands
+#define SPLICE_CHUNK            (64 * 1024)
+
+size_t g_out_high = DEFAULT_OUT_HIGH;
+size_t g_out_low = DEFAULT_OUT_HIGH / 4;
+bool g_splice = false;
+
+//***************************************************************************
+// result cache
+//
+// Output of read-only commands named with -a is kept for -T milliseconds and
+// served again to any client that runs the same argv. The cache lives in
+// shared memory, so all handler processes use one cache. Only output of
+// commands that exit with 0 and fit into a slot is stored.
+
+#define CACHE_SLOTS             64
+#define CACHE_WAYS              4       // slots probed for one key
+#define CACHE_KEY_MAX           256     // argv joined by '\0'
+#define CACHE_DATA_MAX          (64 * 1024)
+#define DEFAULT_CACHE_TTL_MS    2000
+
+struct CacheSlot
+{
+    long expires;                       // now_ms() when the entry gets stale
+    int key_len;
+    int data_len;
+    char key[CACHE_KEY_MAX];
+    char data[CACHE_DATA_MAX];
+};
+
+struct ResultCache
+{
+    pthread_mutex_t lock;
+    long hits;
+    long misses;
+    long stores;
+    CacheSlot slots[CACHE_SLOTS];
+};
+
+ResultCache *g_cache = NULL;
+std::vector<std::string> g_cache_allow; // command names that may be cached
+long g_cache_ttl = DEFAULT_CACHE_TTL_MS;
+
+void cache_init()
+{
+    g_cache = (ResultCache *)shared_alloc(sizeof(ResultCache));
+    shared_mutex_init(&g_cache->lock);
+}
+
+// Fills t_key with the cache key of the command, false if it must not be cached
+bool cache_key(char **t_args, std::string &t_key)
+{
+    t_key.clear();
+    if (!g_cache || std::find(g_cache_allow.begin(), g_cache_allow.end(), t_args[0]) == g_cache_allow.end())
+        return false;
+
+    for (char **l_arg = t_args; *l_arg; l_arg++)
+    {
+        t_key += *l_arg;
+        t_key += '\0';
+    }
+    if (t_key.size() > CACHE_KEY_MAX)
+    {
+        t_key.clear();
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a, picks the first slot probed for the key
+int cache_index(const std::string &t_key)
+{
+    unsigned l_hash = 2166136261u;
+    for (unsigned char l_c : t_key)
+        l_hash = (l_hash ^ l_c) * 16777619u;
+    return l_hash % CACHE_SLOTS;
+}
+
+bool cache_lookup(const std::string &t_key, std::string &t_data)
+{
+    int l_first = cache_index(t_key);
+    long l_now = now_ms();
+    bool l_hit = false;
+
+    shared_lock(&g_cache->lock);
+    for (int i = 0; i < CACHE_WAYS && !l_hit; i++)
+    {
+        CacheSlot *l_slot = &g_cache->slots[(l_first + i) % CACHE_SLOTS];
+        if (l_slot->expires > l_now && l_slot->key_len == (int)t_key.size() &&
+            !memcmp(l_slot->key, t_key.data(), t_key.size()))
+        {
+            t_data.assign(l_slot->data, l_slot->data_len);
+            l_hit = true;
+        }
+    }
+    if (l_hit)
+        g_cache->hits++;
+    else
+        g_cache->misses++;
+    pthread_mutex_unlock(&g_cache->lock);
+
+    return l_hit;
+}
+
+// Stores into the slot with the same key, or the one that gets stale first
+void cache_store(const std::string &t_key, const std::string &t_data)
+{
+    if (t_key.size() > CACHE_KEY_MAX || t_data.size() > CACHE_DATA_MAX)
+        return;
+    int l_first = cache_index(t_key);
+
+    shared_lock(&g_cache->lock);
+    CacheSlot *l_victim = NULL;
+    for (int i = 0; i < CACHE_WAYS; i++)
+    {
+        CacheSlot *l_slot = &g_cache->slots[(l_first + i) % CACHE_SLOTS];
+        if (l_slot->key_len == (int)t_key.size() && !memcmp(l_slot->key, t_key.data(), t_key.size()))
+        {
+            l_victim = l_slot;
+            break;
+        }
+        if (!l_victim || l_slot->expires < l_victim->expires)
+            l_victim = l_slot;
+    }
+
+    memcpy(l_victim->key, t_key.data(), t_key.size());
+    l_victim->key_len = t_key.size();
+    memcpy(l_victim->data, t_data.data(), t_data.size());
+    l_victim->data_len = t_data.size();
+    l_victim->expires = now_ms() + g_cache_ttl;
+    g_cache->stores++;
+    pthread_mutex_unlock(&g_cache->lock);
+}
+
+void print_cache_stats()
+{
+    if (!g_cache)
+    {
+        log_msg(LOG_INFO, "Result cache is off, enable it with -a.");
+        return;
+    }
+    shared_lock(&g_cache->lock);
+    long l_hits = g_cache->hits, l_misses = g_cache->misses, l_stores = g_cache->stores;
+    pthread_mutex_unlock(&g_cache->lock);
+    log_msg(LOG_INFO, "Cache: %ld hits, %ld misses, %ld stores.", l_hits, l_misses, l_stores);
+}
+
+// Splits "ls,date" into the allowlist
+void cache_allow(const char *t_list)
+{
+    std::string l_list = t_list;
+    size_t l_pos = 0;
+    while (l_pos <= l_list.size())
+    {
+        size_t l_end = l_list.find(',', l_pos);
+        if (l_end == std::string::npos)
+            l_end = l_list.size();
+        if (l_end > l_pos)
+            g_cache_allow.push_back(l_list.substr(l_pos, l_end - l_pos));
+        l_pos = l_end + 1;
+    }
+}
+
+// What an epoll event belongs to
+enum HandleKind { H_LISTEN, H_STDIN, H_CLIENT, H_OUTPUT, H_EXIT };
+
+struct Session;
+
+struct Handle
+{
+    HandleKind kind;
+    Session *session;
+    struct Command *command;
+};
+
+// Command started by a session, its output is read from a pipe
+struct Command
+{
+    int id;
+    pid_t pid;
+    int fd_out;                         // read end of the stdout/stderr pipe, -1 at EOF
+    int fd_exit;                        // pidfd, used only after EOF of a running command
+    bool done;
+    bool polled;                        // on the reaping list of the reactor
+    bool blocked;                       // output not read because of the high watermark
+    long bytes;                         // output relayed to the client
+    long started;                       // now_us() at start
+    std::string name;                   // argv[0], row in the accounting table
+    std::string cache_key;              // empty if the output is not cached
+    std::string captured;               // output kept for the cache
+    Handle h_out;
+    Handle h_exit;
+};
+
+// Client connection
+struct Session
+{
+    int sock;
+    Handle h_client;
+    LineReader reader;
+    bool pipelined;                     // framed output, up to g_cmd_limit commands
+    bool reading;                       // client did not close its side yet
+    bool paused;                        // unread data waits for a free command slot
+    bool throttled;                     // output above the high watermark
+    bool closed;
+    int next_id;
+    std::vector<Command *> running;
+    std::string out;                    // output not yet accepted by the socket
+    size_t out_pos;                     // bytes of out already sent
+    long bytes;                         // output relayed to the client
+};
+
+struct Reactor
+{
+    int epfd;
+    int sessions;                       // open sessions
+    std::vector<Session *> dead_sessions;   // freed after the current batch of events
+    std::vector<Command *> dead_commands;
+    std::vector<Command *> reaping;     // exits polled with WNOHANG, killed or without a pidfd
+};
+
+void set_nonblock(int t_fd)
+{
+    fcntl(t_fd, F_SETFL, fcntl(t_fd, F_GETFL) | O_NONBLOCK);
+}
+
+void reactor_add(Reactor *t_reactor, int t_fd, uint32_t t_events, Handle *t_handle)
+{
+    epoll_event l_ev;
+    l_ev.events = t_events;
+    l_ev.data.ptr = t_handle;
+    if (epoll_ctl(t_reactor->epfd, EPOLL_CTL_ADD, t_fd, &l_ev) < 0)
+        log_msg(LOG_ERROR, "Unable to add fd %d to epoll.", t_fd);
+}
+
+// Sends as much of the pending output as the socket takes
+void session_flush(Session *t_session)
+{
+    while (t_session->out_pos < t_session->out.size())
+    {
+        ssize_t l_len = send(t_session->sock, t_session->out.data() + t_session->out_pos,
+                             t_session->out.size() - t_session->out_pos, MSG_NOSIGNAL);
+        if (l_len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                // client is gone, nobody reads the rest
+                log_msg(LOG_DEBUG, "Unable to send data to client.");
+                t_session->reading = false;
+                t_session->out_pos = t_session->out.size();
+            }
+            break;
+        }
+        t_session->out_pos += l_len;
+    }
+
+    // drop the sent part, so the buffer does not grow while output streams
+    if (t_session->out_pos == t_session->out.size())
+    {
+        t_session->out.clear();
+        t_session->out_pos = 0;
+    }
+    else if (t_session->out_pos > t_session->out.size() / 2)
+    {
+        t_session->out.erase(0, t_session->out_pos);
+        t_session->out_pos = 0;
+    }
+}
+
+size_t session_pending(Session *t_session)
+{
+    return t_session->out.size() - t_session->out_pos;
+}
+
+void session_send(Session *t_session, const char *t_buf, size_t t_len)
+{
+    t_session->out.append(t_buf, t_len);
+}
+
+void session_frame(Session *t_session, int t_id, const char *t_buf, size_t t_len)
+{
+    if (!t_session->pipelined)
+    {
+        session_send(t_session, t_buf, t_len);
+        return;
+    }
+    char l_head[64];
+    int l_head_len = snprintf(l_head, sizeof(l_head), "#%d out %d\n", t_id, (int)t_len);
+    session_send(t_session, l_head, l_head_len);
+    session_send(t_session, t_buf, t_len);
+}
+
+void session_exit_frame(Session *t_session, int t_id, int t_status)
+{
+    if (!t_session->pipelined)
+        return;
+    char l_head[64];
+    int l_len = snprintf(l_head, sizeof(l_head), "#%d exit %d\n", t_id, t_status);
+    session_send(t_session, l_head, l_len);
+}
+
+// Kills all running commands of the session. SIGTERM could be ignored, and
+// the loop must not wait for them, they are reaped later from the reaping list.
+void stop_commands(Reactor *t_reactor, Session *t_session)
+{
+    for (Command *l_cmd : t_session->running)
+    {
+        kill(l_cmd->pid, SIGKILL);
+        if (l_cmd->fd_out >= 0)
+            close(l_cmd->fd_out);
+        if (l_cmd->fd_exit >= 0)
+            close(l_cmd->fd_exit);
+        l_cmd->fd_out = l_cmd->fd_exit = -1;
+        l_cmd->done = true;
+        if (!l_cmd->polled)
+        {
+            l_cmd->polled = true;
+            t_reactor->reaping.push_back(l_cmd);
+        }
+    }
+    t_session->running.clear();
+}
+
+void session_close(Reactor *t_reactor, Session *t_session)
+{
+    if (t_session->closed)
+        return;
+    stop_commands(t_reactor, t_session);
+    close(t_session->sock);
+    t_session->closed = true;
+    t_reactor->sessions--;
+    t_reactor->dead_sessions.push_back(t_session);
+    log_msg(LOG_DEBUG, "Session on socket %d closed.", t_session->sock);
+}
+
+Session *session_new(Reactor *t_reactor, int t_sock)
+{
+    Session *l_session = new Session();
+    l_session->sock = t_sock;
+    l_session->h_client = {H_CLIENT, l_session, NULL};
+    line_init(&l_session->reader);
+    l_session->pipelined = false;
+    l_session->reading = true;
+    l_session->paused = false;
+    l_session->throttled = false;
+    l_session->closed = false;
+    l_session->next_id = 1;
+    l_session->out_pos = 0;
+    l_session->bytes = 0;
+
+    // output and exit frames of a command leave in separate sends, Nagle
+    // would hold the second one for the delayed ACK of the client
+    int l_opt = 1;
+    setsockopt(t_sock, IPPROTO_TCP, TCP_NODELAY, &l_opt, sizeof(l_opt));
+
+    set_nonblock(t_sock);
+    reactor_add(t_reactor, t_sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &l_session->h_client);
+    t_reactor->sessions++;
+    return l_session;
+}
+
+// Starts the command with its output going into a pipe, returns NULL if it could not run
+Command *start_command(Reactor *t_reactor, Session *t_session, char **t_args, int t_id)
+{
+    int l_pipe[2];
+    if (pipe2(l_pipe, O_CLOEXEC) < 0)
+    {
+        log_msg(LOG_ERROR, "Unable to create pipe for command %d.", t_id);
+        return NULL;
+    }
+
+    pid_t l_pid = spawn_command(t_args, l_pipe[1]);
+    close(l_pipe[1]);
+    if (l_pid < 0)
+    {
+        log_msg(LOG_DEBUG, "Unable to start '%s': %s", t_args[0], strerror(errno));
+        close(l_pipe[0]);
+        return NULL;
+    }
+
+    Command *l_cmd = new Command();
+    l_cmd->id = t_id;
+    l_cmd->pid = l_pid;
+    l_cmd->fd_out = l_pipe[0];
+    l_cmd->fd_exit = -1;
+    l_cmd->polled = false;
+    l_cmd->done = false;
+    l_cmd->blocked = false;
+    l_cmd->bytes = 0;
+    l_cmd->started = now_us();
+    l_cmd->name = t_args[0];
+    l_cmd->h_out = {H_OUTPUT, t_session, l_cmd};
+    l_cmd->h_exit = {H_EXIT, t_session, l_cmd};
+
+    set_nonblock(l_cmd->fd_out);
+    reactor_add(t_reactor, l_cmd->fd_out, EPOLLIN | EPOLLET, &l_cmd->h_out);
+    log_msg(LOG_DEBUG, "Command %d '%s' started as %d.", t_id, t_args[0], l_pid);
+    return l_cmd;
+}
+
+void session_read(Reactor *t_reactor, Session *t_session);
+
+// Starts commands from complete lines while the session has a free slot
+void session_pump(Reactor *t_reactor, Session *t_session)
+{
+    std::vector<char *> args;
+    std::string l_line;
+
+    while (!t_session->closed &&
+           (int)t_session->running.size() < (t_session->pipelined ? g_cmd_limit : 1))
+    {
+        int l_next = line_next(&t_session->reader, l_line, !t_session->reading);
+        if (!l_next)
+            break;
+
+        if (l_next < 0)
+        {
+            int l_id = t_session->next_id++;
+            session_frame(t_session, l_id, STR_LINE_TOO_LONG, strlen(STR_LINE_TOO_LONG));
+            session_exit_frame(t_session, l_id, 127);
+            continue;
+        }
+        log_msg(LOG_DEBUG, "Command from client: %s", l_line.c_str());
+
+        if (is_builtin(l_line, STR_CLOSE))
+        {
+            log_msg(LOG_INFO, "Client sent 'close' request to close connection.");
+            session_close(t_reactor, t_session);
+            return;
+        }
+
+        if (!t_session->pipelined && is_builtin(l_line, STR_PIPELINE))
+        {
+            log_msg(LOG_INFO, "Client switched to pipelined commands.");
+            t_session->pipelined = true;
+            char l_ack[64];
+            int l_len = snprintf(l_ack, sizeof(l_ack), "#0 %s %d\n", STR_PIPELINE, g_cmd_limit);
+            session_send(t_session, l_ack, l_len);
+            continue;
+        }
+
+        if (is_builtin(l_line, STR_STATS))
+        {
+            int l_id = t_session->next_id++;
+            std::string l_table = stats_summary();
+            session_frame(t_session, l_id, l_table.data(), l_table.size());
+            session_exit_frame(t_session, l_id, 0);
+            continue;
+        }
+
+        if (split_args(l_line, args) == 0)
+            continue; // Empty command
+
+        int l_id = t_session->next_id++;
+        std::string l_key, l_cached;
+        bool l_cacheable = cache_key(args.data(), l_key);
+        if (l_cacheable && cache_lookup(l_key, l_cached))
+        {
+            log_msg(LOG_DEBUG, "Command %d '%s' served from cache.", l_id, args[0]);
+            if (!l_cached.empty())
+                session_frame(t_session, l_id, l_cached.data(), l_cached.size());
+            session_exit_frame(t_session, l_id, 0);
+            continue;
+        }
+
+        Command *l_cmd = start_command(t_reactor, t_session, args.data(), l_id);
+        if (l_cmd)
+        {
+            if (l_cacheable)
+                l_cmd->cache_key = l_key;
+            t_session->running.push_back(l_cmd);
+            continue;
+        }
+
+        if (t_session->pipelined)
+            session_exit_frame(t_session, l_id, 127);
+        else
+            session_send(t_session, STR_EXEC_FAILED, strlen(STR_EXEC_FAILED));
+    }
+}
+
+// Session ends when the client sent everything and all output went out
+void session_check(Reactor *t_reactor, Session *t_session)
+{
+    if (t_session->closed)
         return;
+    session_flush(t_session);
+    if (!t_session->reading && t_session->running.empty() && t_session->out.empty())
+        session_close(t_reactor, t_session);
+}
 
-    char l_buf[1024];
-    va_list l_arg;
-    va_start(l_arg, t_form);
-    vsnprintf(l_buf, sizeof(l_buf), t_form, l_arg);
-    va_end(l_arg);
+// Reads commands until the socket is drained (edge-triggered) or the slots are full
+void session_read(Reactor *t_reactor, Session *t_session)
+{
+    t_session->paused = false;
+    session_pump(t_reactor, t_session);
 
-    switch (t_log_level)
+    while (t_session->reading && !t_session->closed)
     {
-    case LOG_INFO:
-    case LOG_DEBUG:
-        fprintf(stdout, out_fmt[t_log_level], l_buf);
-        break;
+        if ((int)t_session->running.size() >= (t_session->pipelined ? g_cmd_limit : 1))
+        {
+            t_session->paused = true;   // continue when a command finishes
+            break;
+        }
 
-    case LOG_ERROR:
-        fprintf(stderr, out_fmt[t_log_level], errno, strerror(errno), l_buf);
-        break;
+        int l_len = line_fill(&t_session->reader, t_session->sock);
+        if (l_len < 0 && errno == EINTR)
+            continue;
+        if (l_len < 0 && errno == EAGAIN)
+            break;
+        if (l_len <= 0)
+        {
+            // client shut down its side, results of commands still go out
+            log_msg(LOG_DEBUG, "Client closed socket!");
+            t_session->reading = false;
+        }
+        session_pump(t_reactor, t_session);
     }
+
+    session_check(t_reactor, t_session);
 }
 
-// Function to handle communication with a client
-void handle_client(int l_sock_client)
+void command_finish(Reactor *t_reactor, Session *t_session, Command *t_cmd, int t_status)
 {
-    char l_buf[1024];
+    log_msg(LOG_DEBUG, "Command %d finished with status %d, %ld bytes of output.",
+            t_cmd->id, exit_status(t_status), t_cmd->bytes);
+    session_exit_frame(t_session, t_cmd->id, exit_status(t_status));
+
+    if (!t_cmd->cache_key.empty() && t_status == 0)
+        cache_store(t_cmd->cache_key, t_cmd->captured);
+
+    t_cmd->done = true;
+    if (t_cmd->fd_exit >= 0)
+        close(t_cmd->fd_exit);
+    t_session->running.erase(std::find(t_session->running.begin(), t_session->running.end(), t_cmd));
+    t_reactor->dead_commands.push_back(t_cmd);
+
+    if (t_session->paused)
+        session_read(t_reactor, t_session);
+    else
+    {
+        session_pump(t_reactor, t_session);
+        session_check(t_reactor, t_session);
+    }
+}
+
+// Reaps the command, or waits for its pidfd when it closed the output but
+// still runs. Without pidfds the reactor polls its exit.
+void command_reap(Reactor *t_reactor, Session *t_session, Command *t_cmd)
+{
+    int l_status = 0;
+    rusage l_usage = {};
+    pid_t l_pid = wait4(t_cmd->pid, &l_status, WNOHANG, &l_usage);
+    if (l_pid == 0)
+    {
+        if (t_cmd->fd_exit < 0 && !t_cmd->polled)
+        {
+            t_cmd->fd_exit = syscall(SYS_pidfd_open, t_cmd->pid, 0);
+            if (t_cmd->fd_exit >= 0)
+                reactor_add(t_reactor, t_cmd->fd_exit, EPOLLIN, &t_cmd->h_exit);
+            else
+            {
+                t_cmd->polled = true;
+                t_reactor->reaping.push_back(t_cmd);
+            }
+        }
+        return;
+    }
+    if (t_cmd->polled)
+    {
+        t_cmd->polled = false;
+        t_reactor->reaping.erase(std::find(t_reactor->reaping.begin(), t_reactor->reaping.end(), t_cmd));
+    }
+    stats_record(t_cmd->name.c_str(), exit_status(l_status), &l_usage, now_us() - t_cmd->started);
+    command_finish(t_reactor, t_session, t_cmd, l_status);
+}
+
+// Reaps commands on the reaping list that exited. Killed ones are freed,
+// their usage counts like that of any other command.
+void reactor_reap(Reactor *t_reactor)
+{
+    std::vector<Command *> l_list = t_reactor->reaping;
+    for (Command *l_cmd : l_list)
+    {
+        if (!l_cmd->done)
+        {
+            command_reap(t_reactor, l_cmd->h_exit.session, l_cmd);
+            continue;
+        }
+        int l_status = 0;
+        rusage l_usage = {};
+        pid_t l_pid = wait4(l_cmd->pid, &l_status, WNOHANG, &l_usage);
+        if (l_pid == 0)
+            continue;
+        if (l_pid > 0)
+            stats_record(l_cmd->name.c_str(), exit_status(l_status), &l_usage, now_us() - l_cmd->started);
+        t_reactor->reaping.erase(std::find(t_reactor->reaping.begin(), t_reactor->reaping.end(), l_cmd));
+        delete l_cmd;
+    }
+}
 
+// Moves the output from the pipe straight to the socket, true at EOF of the pipe.
+// EAGAIN may come from either side, so both the pipe and the socket retry.
+bool command_splice(Session *t_session, Command *t_cmd)
+{
     while (1)
     {
-        // Read data from client
-        int l_len = read(l_sock_client, l_buf, sizeof(l_buf) - 1);
-        if (l_len == 0)
+        ssize_t l_len = splice(t_cmd->fd_out, NULL, t_session->sock, NULL, SPLICE_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (l_len > 0)
         {
-            log_msg(LOG_DEBUG, "Client closed socket!");
-            close(l_sock_client);
-            exit(0);
+            t_cmd->bytes += l_len;
+            t_session->bytes += l_len;
+            continue;
+        }
+        if (l_len < 0 && errno == EINTR)
+            continue;
+        if (l_len < 0 && errno == EAGAIN)
+            return false;
+        if (l_len < 0 && (errno == EPIPE || errno == ECONNRESET))
+        {
+            // client is gone, the rest of the output is dropped
+            log_msg(LOG_DEBUG, "Client of command %d closed its socket.", t_cmd->id);
+            t_session->reading = false;
         }
         else if (l_len < 0)
         {
-            log_msg(LOG_ERROR, "Unable to read data from client.");
-            close(l_sock_client);
-            exit(1);
+            // splice() is not possible here, copy the output from now on
+            log_msg(LOG_ERROR, "Unable to splice output of command %d, copying instead.", t_cmd->id);
+            g_splice = false;
+            return false;
         }
-        else
+        return true;
+    }
+}
+
+// Moves what the command wrote into the session output, up to the high watermark
+void command_read(Reactor *t_reactor, Session *t_session, Command *t_cmd)
+{
+    char l_buf[FRAME_CHUNK];
+
+    if (t_session->throttled)
+    {
+        t_cmd->blocked = true;
+        return;
+    }
+
+    if (g_splice && !t_session->pipelined && !session_pending(t_session) &&
+        t_cmd->fd_out >= 0 && t_cmd->cache_key.empty())
+    {
+        if (command_splice(t_session, t_cmd))
         {
-            l_buf[l_len] = '\0'; // Null-terminate the received string
-            log_msg(LOG_DEBUG, "Received %d bytes from client: %s", l_len, l_buf);
+            close(t_cmd->fd_out);
+            t_cmd->fd_out = -1;
+        }
+    }
 
-            // Remove trailing newline character
-            if (l_buf[l_len - 1] == '\n')
+    while (t_cmd->fd_out >= 0)
+    {
+        if (session_pending(t_session) >= g_out_high)
+        {
+            session_flush(t_session);
+            if (session_pending(t_session) >= g_out_high)
             {
-                l_buf[l_len - 1] = '\0';
+                // client is slow, the command waits on its full pipe
+                t_session->throttled = true;
+                t_cmd->blocked = true;
+                log_msg(LOG_DEBUG, "Output of session on socket %d paused.", t_session->sock);
+                break;
             }
+        }
 
-            // Check for "close" command
-            if (!strncasecmp(l_buf, STR_CLOSE, strlen(STR_CLOSE)))  // Case-insensitive comparison
+        int l_len = read(t_cmd->fd_out, l_buf, sizeof(l_buf));
+        if (l_len > 0)
+        {
+            t_cmd->bytes += l_len;
+            t_session->bytes += l_len;
+            session_frame(t_session, t_cmd->id, l_buf, l_len);
+            if (!t_cmd->cache_key.empty())
             {
-                log_msg(LOG_INFO, "Client sent 'close' request to close connection.");
-                close(l_sock_client);
-                exit(0);
+                if (t_cmd->captured.size() + l_len <= CACHE_DATA_MAX)
+                    t_cmd->captured.append(l_buf, l_len);
+                else
+                    t_cmd->cache_key.clear(); // too big for the cache
             }
+            continue;
+        }
+        if (l_len < 0 && errno == EINTR)
+            continue;
+        if (l_len < 0 && errno == EAGAIN)
+            break;
 
-            // Split the command into arguments
-            char *args[16];
-            int argc = 0;
-            char *token = strtok(l_buf, " ");
-            while (token != NULL && argc < 15)
-            {
-                args[argc++] = token;
-                token = strtok(NULL, " "); // Get next token
-            }
-            args[argc] = NULL; // Null-terminate the arguments array
+        // EOF or error, command closed its output
+        close(t_cmd->fd_out);
+        t_cmd->fd_out = -1;
+    }
 
-            if (argc == 0)
-            {
-                continue; // Empty command
-            }
+    session_flush(t_session);
+    if (t_cmd->fd_out < 0)
+        command_reap(t_reactor, t_session, t_cmd);
+}
 
-            // Fork a child process to execute the command
-            pid_t pid = fork();
-            if (pid < 0)
-            {
-                log_msg(LOG_ERROR, "Fork failed.");
+// Client took output: resume paused commands below the low watermark,
+// or continue a splice that waited for the socket
+void session_writable(Reactor *t_reactor, Session *t_session)
+{
+    session_flush(t_session);
+
+    if (t_session->throttled && session_pending(t_session) <= g_out_low)
+    {
+        log_msg(LOG_DEBUG, "Output of session on socket %d resumed.", t_session->sock);
+        t_session->throttled = false;
+        std::vector<Command *> l_blocked;
+        for (Command *l_cmd : t_session->running)
+            if (l_cmd->blocked)
+                l_blocked.push_back(l_cmd);
+        for (Command *l_cmd : l_blocked)
+        {
+            l_cmd->blocked = false;
+            if (!t_session->closed && !l_cmd->done)
+                command_read(t_reactor, t_session, l_cmd);
+        }
+    }
+    else if (g_splice && !t_session->pipelined && !t_session->running.empty() &&
+             t_session->running[0]->cache_key.empty())
+        command_read(t_reactor, t_session, t_session->running[0]);
+}
+
+void reactor_init(Reactor *t_reactor)
+{
+    t_reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t_reactor->epfd < 0)
+    {
+        log_msg(LOG_ERROR, "Unable to create epoll.");
+        exit(1);
+    }
+    t_reactor->sessions = 0;
+}
+
+// Dispatches events until quit is entered, or for a single session until it ends
+void reactor_run(Reactor *t_reactor, int t_sock_listen)
+{
+    epoll_event l_events[EPOLL_EVENTS];
+
+    while (t_sock_listen >= 0 || t_reactor->sessions > 0 || !t_reactor->reaping.empty())
+    {
+        int l_count = epoll_wait(t_reactor->epfd, l_events, EPOLL_EVENTS,
+                                 t_reactor->reaping.empty() ? -1 : REAP_POLL_MS);
+        if (l_count < 0)
+        {
+            if (errno == EINTR)
                 continue;
-            }
-            else if (pid == 0)
-            {
-                // Child process
-                // Redirect stdout to the client socket
-                dup2(l_sock_client, STDOUT_FILENO);
-                dup2(l_sock_client, STDERR_FILENO);
+            log_msg(LOG_ERROR, "Function epoll_wait failed!");
+            exit(1);
+        }
 
-                close(l_sock_client);
+        for (int i = 0; i < l_count; i++)
+        {
+            Handle *l_handle = (Handle *)l_events[i].data.ptr;
+            Session *l_session = l_handle->session;
+            Command *l_cmd = l_handle->command;
 
-                // Execute the command
-                execvp(args[0], args);
+            if (l_session && l_session->closed)
+                continue;
+            if (l_cmd && l_cmd->done)
+                continue;
 
-                // If execvp returns, it must have failed
-                printf("Error: Command execution failed\n");
-                exit(1);
-            }
-            else
+            switch (l_handle->kind)
             {
-                wait(NULL);
+            case H_LISTEN:
+                while (1)
+                {
+                    int l_sock_client = accept4(t_sock_listen, NULL, NULL, SOCK_CLOEXEC);
+                    if (l_sock_client < 0)
+                    {
+                        if (errno != EAGAIN && errno != EINTR)
+                            log_msg(LOG_ERROR, "Unable to accept new client.");
+                        if (errno != EINTR)
+                            break;
+                        continue;
+                    }
+                    log_client(l_sock_client);
+                    session_new(t_reactor, l_sock_client);
+                }
+                break;
+
+            case H_STDIN:
+                if (read_quit())
+                {
+                    log_msg(LOG_INFO, "Request to 'quit' entered.");
+                    close(t_sock_listen);
+                    exit(0);
+                }
+                break;
+
+            case H_CLIENT:
+                if (l_events[i].events & EPOLLOUT)
+                    session_writable(t_reactor, l_session);
+                if (l_session->closed)
+                    break;
+                if (l_events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    session_read(t_reactor, l_session);
+                else
+                    session_check(t_reactor, l_session);
+                break;
+
+            case H_OUTPUT:
+                command_read(t_reactor, l_session, l_cmd);
+                break;
+
+            case H_EXIT:
+                command_reap(t_reactor, l_session, l_cmd);
+                break;
             }
         }
+
+        reactor_reap(t_reactor);
+        for (Command *l_dead : t_reactor->dead_commands)
+            delete l_dead;
+        t_reactor->dead_commands.clear();
+        for (Session *l_dead : t_reactor->dead_sessions)
+            delete l_dead;
+        t_reactor->dead_sessions.clear();
+    }
+}
+
+// Function to handle communication with a client, returns when the client is gone.
+// The handler process runs the event loop with this one session.
+void handle_client(int l_sock_client)
+{
+    Reactor l_reactor;
+    reactor_init(&l_reactor);
+
+    Session *l_session = session_new(&l_reactor, l_sock_client);
+    session_read(&l_reactor, l_session);
+
+    reactor_run(&l_reactor, -1);
+    close(l_reactor.epfd);
+}
+
+//***************************************************************************
+// pre-forked pool
+
+void pool_notify()
+{
+    int l_errno = errno;
+    char l_byte = 0;
+    write(g_pool_notify[1], &l_byte, 1); // pipe full means a wake up is pending anyway
+    errno = l_errno;
+}
+
+void sigchld_handler(int)
+{
+    pool_notify();
+}
+
+void pool_init()
+{
+    g_pool = (PoolState *)shared_alloc(sizeof(PoolState));
+    g_pool->idle = 0;
+    shared_mutex_init(&g_pool->accept_lock);
+
+    if (pipe2(g_pool_notify, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        log_msg(LOG_ERROR, "Unable to create pool pipe.");
+        exit(1);
+    }
+
+    struct sigaction l_sa;
+    memset(&l_sa, 0, sizeof(l_sa));
+    l_sa.sa_handler = sigchld_handler;
+    l_sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &l_sa, NULL);
+}
+
+// Main loop of a handler process: serve one client after another
+void pool_worker(int l_sock_listen, pid_t t_server)
+{
+    signal(SIGCHLD, SIG_DFL);   // commands of the client are reaped by wait()
+
+    // handlers end together with the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != t_server)
+        exit(0);
+
+    while (1)
+    {
+        shared_lock(&g_pool->accept_lock);
+        int l_sock_client = accept4(l_sock_listen, NULL, NULL, SOCK_CLOEXEC);
+        pthread_mutex_unlock(&g_pool->accept_lock);
+
+        if (l_sock_client == -1)
+        {
+            if (errno != EINTR)
+                log_msg(LOG_ERROR, "Unable to accept new client.");
+            continue;
+        }
+
+        // last idle handler is busy now, ask the server for another one
+        if (__atomic_sub_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST) == 0)
+            pool_notify();
+
+        log_client(l_sock_client);
+        handle_client(l_sock_client);
+
+        // extra handlers forked during a burst leave once it is over
+        if (__atomic_add_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST) > g_pool_size)
+        {
+            if (__atomic_sub_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST) >= g_pool_size)
+                exit(0);
+            __atomic_add_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+// Reaps finished handlers and forks new ones, so there are at least g_pool_size
+// handlers and an idle one whenever the bound g_pool_max allows it
+void pool_maintain(int l_sock_listen, int *t_workers)
+{
+    char l_drain[64];
+    while (read(g_pool_notify[0], l_drain, sizeof(l_drain)) > 0)
+        ;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        (*t_workers)--;
+
+    pid_t l_server = getpid();
+    while (*t_workers < g_pool_size ||
+           (*t_workers < g_pool_max && __atomic_load_n(&g_pool->idle, __ATOMIC_SEQ_CST) == 0))
+    {
+        __atomic_add_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            __atomic_sub_fetch(&g_pool->idle, 1, __ATOMIC_SEQ_CST);
+            log_msg(LOG_ERROR, "Fork failed.");
+            return;
+        }
+        else if (pid == 0)
+        {
+            close(g_pool_notify[0]);
+            pool_worker(l_sock_listen, l_server);
+            exit(0);
+        }
+        (*t_workers)++;
+        log_msg(LOG_DEBUG, "Handler %d started, %d handlers running.", pid, *t_workers);
     }
 }
 
@@ -163,7 +1589,7 @@ int main(int t_narg, char **t_args)
 {
     if (t_narg <= 1)
     {
-        printf("Usage: %s [-h -d] port_number\n", t_args[0]);
+        printf("Usage: %s [-h -d -e -z -p pool_size -P pool_max -c cmd_limit -w watermark -a cmd,... -T ttl_ms -C cpu_s -M mem_mb -F files -G cgroup] port_number\n", t_args[0]);
         exit(1);
     }
 
@@ -175,18 +1601,101 @@ int main(int t_narg, char **t_args)
         if (!strcmp(t_args[i], "-d"))
             g_debug = LOG_DEBUG;
 
+        if (!strcmp(t_args[i], "-p") && i + 1 < t_narg)
+        {
+            g_pool_size = atoi(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-P") && i + 1 < t_narg)
+        {
+            g_pool_max = atoi(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-e"))
+            g_event_loop = true;
+
+        if (!strcmp(t_args[i], "-z"))
+            g_splice = true;
+
+        if (!strcmp(t_args[i], "-a") && i + 1 < t_narg)
+        {
+            cache_allow(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-T") && i + 1 < t_narg)
+        {
+            g_cache_ttl = atol(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-C") && i + 1 < t_narg)
+        {
+            g_limit_cpu = atol(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-M") && i + 1 < t_narg)
+        {
+            g_limit_as = atol(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-F") && i + 1 < t_narg)
+        {
+            g_limit_files = atol(t_args[++i]);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-G") && i + 1 < t_narg)
+        {
+            const char *l_dir = t_args[++i];
+            g_cgroup_procs = (char *)malloc(strlen(l_dir) + sizeof("/cgroup.procs"));
+            sprintf(g_cgroup_procs, "%s/cgroup.procs", l_dir);
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-w") && i + 1 < t_narg)
+        {
+            g_out_high = atol(t_args[++i]);
+            g_out_low = g_out_high / 4;
+            continue;
+        }
+
+        if (!strcmp(t_args[i], "-c") && i + 1 < t_narg)
+        {
+            g_cmd_limit = atoi(t_args[++i]);
+            continue;
+        }
+
         if (!strcmp(t_args[i], "-h"))
         {
             printf(
                 "\n"
                 "  Socket server example.\n"
                 "\n"
-                "  Use: %s [-h -d] port_number\n"
+                "  Use: %s [-h -d -e -z -p pool_size -P pool_max -c cmd_limit -w watermark -a cmd,... -T ttl_ms -C cpu_s -M mem_mb -F files -G cgroup] port_number\n"
                 "\n"
                 "    -d  debug mode \n"
+                "    -e  serve all clients from one epoll event loop\n"
+                "    -p  pre-fork pool_size client handlers\n"
+                "    -P  upper bound of handlers (default %d * pool_size)\n"
+                "    -c  commands running at once per client after '%s' (default %d)\n"
+                "    -w  pending output in bytes that pauses commands of a client (default %d)\n"
+                "    -z  splice plain command output from pipe to socket\n"
+                "    -a  cache output of these read-only commands (comma separated)\n"
+                "    -T  lifetime of cached output in ms (default %d)\n"
+                "    -C  CPU time limit of each command in seconds\n"
+                "    -M  address space limit of each command in MiB\n"
+                "    -F  open files limit of each command\n"
+                "    -G  move commands into this cgroup v2 directory\n"
                 "    -h  this help\n"
+                "\n"
+                "  Send '%s' as a command to get CPU, memory and time used by commands.\n"
                 "\n",
-                t_args[0]);
+                t_args[0], POOL_GROWTH, STR_PIPELINE, DEFAULT_CMD_LIMIT, DEFAULT_OUT_HIGH, DEFAULT_CACHE_TTL_MS, STR_STATS);
 
             exit(0);
         }
@@ -204,10 +1713,55 @@ int main(int t_narg, char **t_args)
         exit(1);
     }
 
+    if (g_pool_size < 0 || g_pool_max < 0)
+    {
+        log_msg(LOG_INFO, "Bad pool size!");
+        exit(1);
+    }
+    if (g_cmd_limit <= 0)
+    {
+        log_msg(LOG_INFO, "Bad command limit %d!", g_cmd_limit);
+        exit(1);
+    }
+    if (g_out_high < FRAME_CHUNK)
+    {
+        log_msg(LOG_INFO, "Watermark must be at least %d bytes!", FRAME_CHUNK);
+        exit(1);
+    }
+    if (g_limit_cpu < 0 || g_limit_as < 0 || g_limit_files < 0)
+    {
+        log_msg(LOG_INFO, "Bad command limits!");
+        exit(1);
+    }
+    if (g_cgroup_procs && access(g_cgroup_procs, W_OK) < 0)
+    {
+        log_msg(LOG_ERROR, "Unable to move commands into cgroup via '%s'.", g_cgroup_procs);
+        exit(1);
+    }
+    if (g_pool_size && !g_pool_max)
+        g_pool_max = POOL_GROWTH * g_pool_size;
+    if (g_pool_max < g_pool_size)
+        g_pool_max = g_pool_size;
+
+    stats_init();
+    if (g_limit_cpu || g_limit_as || g_limit_files || g_cgroup_procs)
+        log_msg(LOG_INFO, "Commands limited to %ld s CPU, %ld MiB, %ld files (0 = no limit).",
+                g_limit_cpu, g_limit_as, g_limit_files);
+
+    if (!g_cache_allow.empty())
+    {
+        cache_init();
+        log_msg(LOG_INFO, "Caching output of %d commands for %ld ms.", (int)g_cache_allow.size(), g_cache_ttl);
+    }
+
     log_msg(LOG_INFO, "Server will listen on port: %d.", l_port);
 
+    // a client that reset its socket must not kill the server in splice()
+    signal(SIGPIPE, SIG_IGN);
+
     // socket creation
-    int l_sock_listen = socket(AF_INET, SOCK_STREAM, 0);
+    // close-on-exec keeps the socket out of the commands started by handlers
+    int l_sock_listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (l_sock_listen == -1)
     {
         log_msg(LOG_ERROR, "Unable to create socket.");
@@ -234,14 +1788,29 @@ int main(int t_narg, char **t_args)
     }
 
     // listening on set port
-    if (listen(l_sock_listen, 5) < 0)
+    if (listen(l_sock_listen, SOMAXCONN) < 0)
     {
         log_msg(LOG_ERROR, "Unable to listen on given port!");
         close(l_sock_listen);
         exit(1);
     }
 
-    log_msg(LOG_INFO, "Enter 'quit' to quit server.");
+    log_msg(LOG_INFO, "Enter 'quit' to quit server, '%s' for cache statistics, '%s' for commands.",
+            STR_CACHE, STR_STATS);
+
+    // one process and one epoll set for all clients
+    if (g_event_loop)
+    {
+        Reactor l_reactor;
+        reactor_init(&l_reactor);
+        Handle l_h_listen = {H_LISTEN, NULL, NULL};
+        Handle l_h_stdin = {H_STDIN, NULL, NULL};
+        set_nonblock(l_sock_listen);
+        reactor_add(&l_reactor, l_sock_listen, EPOLLIN | EPOLLET, &l_h_listen);
+        reactor_add(&l_reactor, STDIN_FILENO, EPOLLIN, &l_h_stdin);
+        log_msg(LOG_INFO, "Serving all clients from one event loop.");
+        reactor_run(&l_reactor, l_sock_listen);
+    }
 
     // list of fd sources
     pollfd l_read_poll[2];
@@ -251,6 +1820,16 @@ int main(int t_narg, char **t_args)
     l_read_poll[1].fd = l_sock_listen;
     l_read_poll[1].events = POLLIN;
 
+    // with a pool the handlers accept, the server only watches them
+    int l_workers = 0;
+    if (g_pool_size)
+    {
+        pool_init();
+        pool_maintain(l_sock_listen, &l_workers);
+        log_msg(LOG_INFO, "Pool of %d handlers started (max %d).", g_pool_size, g_pool_max);
+        l_read_poll[1].fd = g_pool_notify[0];
+    }
+
     // go!
     while (1)
     {
@@ -259,24 +1838,15 @@ int main(int t_narg, char **t_args)
 
         if (l_poll < 0)
         {
+            if (errno == EINTR)
+                continue;
             log_msg(LOG_ERROR, "Function poll failed!");
             exit(1);
         }
 
         if (l_read_poll[0].revents & POLLIN)
         { // data on stdin
-            char buf[128];
-            int len = read(STDIN_FILENO, buf, sizeof(buf));
-            if (len < 0)
-            {
-                log_msg(LOG_DEBUG, "Unable to read from stdin!");
-                exit(1);
-            }
-
-            buf[len] = '\0'; // Null-terminate the string
-            log_msg(LOG_DEBUG, "Read %d bytes from stdin: %s", len, buf);
-            // request to quit?
-            if (!strncmp(buf, STR_QUIT, strlen(STR_QUIT)))
+            if (read_quit())
             {
                 log_msg(LOG_INFO, "Request to 'quit' entered.");
                 close(l_sock_listen);
@@ -284,7 +1854,11 @@ int main(int t_narg, char **t_args)
             }
         }
 
-        if (l_read_poll[1].revents & POLLIN)
+        if (g_pool_size && (l_read_poll[1].revents & POLLIN))
+        { // handler busy or finished
+            pool_maintain(l_sock_listen, &l_workers);
+        }
+        else if (l_read_poll[1].revents & POLLIN)
         { // new client?
             sockaddr_in l_rsa;
             socklen_t l_rsa_size = sizeof(l_rsa);
@@ -295,15 +1869,7 @@ int main(int t_narg, char **t_args)
                 log_msg(LOG_ERROR, "Unable to accept new client.");
                 continue;
             }
-            uint l_lsa = sizeof(l_srv_addr);
-            // my IP
-            getsockname(l_sock_client, (sockaddr *)&l_srv_addr, &l_lsa);
-            log_msg(LOG_INFO, "My IP: '%s'  port: %d",
-                    inet_ntoa(l_srv_addr.sin_addr), ntohs(l_srv_addr.sin_port));
-            // client IP
-            getpeername(l_sock_client, (sockaddr *)&l_srv_addr, &l_lsa);
-            log_msg(LOG_INFO, "Client IP: '%s'  port: %d",
-                    inet_ntoa(l_srv_addr.sin_addr), ntohs(l_srv_addr.sin_port));
+            log_client(l_sock_client);
 
             // Fork a new process to handle the client
             pid_t pid = fork();
@@ -10,6 +10,10 @@
 // The mandatory arguments of program is IP adress or name of server and
 // a port number.
 //
+// With -B it is a benchmark instead. It opens many connections with the
+// binary protocol, sends public and private messages at a given rate and
+// measures how long every message takes to reach each of its recipients.
+//
 //***************************************************************************
 
 #include <unistd.h>
@@ -29,9 +33,30 @@
 #include <errno.h>
 #include <netdb.h>
 #include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
 
 #define STR_CLOSE "#close"
 #define STR_LIST "#list"
+#define STR_BINARY "#binary "
+#define STR_BENCH "bench "
+
+#define BENCH_CLIENTS           1000
+#define BENCH_RATE              1000    // messages per second, all clients together
+#define BENCH_SECONDS           10
+#define BENCH_PRIVATE           10      // percent of private messages
+#define BENCH_THREADS           4
+#define BENCH_SETTLE_MS         500     // the server publishes new clients
+#define BENCH_DRAIN_MS          2000    // deliveries still expected after the end
+#define EPOLL_EVENTS            64
 
 //***************************************************************************
 // log messages
@@ -71,6 +96,396 @@ void log_msg( int t_log_level, const char *t_form, ... )
     }
 }
 
+//***************************************************************************
+// binary protocol of the server
+
+enum FrameType
+{
+    FRAME_MESSAGE = 1,
+    FRAME_PRIVATE = 2,
+    FRAME_LIST = 3
+};
+
+struct FrameHeader
+{
+    uint8_t type;
+    uint8_t reserved[ 3 ];
+    uint32_t length;
+    uint32_t sender;
+};
+
+//***************************************************************************
+// latency histogram, with the buckets of CV6 socket_load so the reports compare
+
+#define HIST_LINEAR             16
+#define HIST_SUB                8
+#define HIST_BUCKETS            ( HIST_LINEAR + 40 * HIST_SUB )
+
+struct Histogram
+{
+    long count;
+    long sum;                           // us
+    long max;                           // us
+    long buckets[ HIST_BUCKETS ];
+};
+
+int hist_index( long t_us )
+{
+    if ( t_us < HIST_LINEAR )
+        return t_us < 0 ? 0 : t_us;
+    int l_exp = 63 - __builtin_clzl( t_us ); // >= 4
+    int l_sub = ( t_us >> ( l_exp - 3 ) ) & ( HIST_SUB - 1 );
+    return std::min( HIST_LINEAR + ( l_exp - 4 ) * HIST_SUB + l_sub, HIST_BUCKETS - 1 );
+}
+
+// Lowest value of the bucket
+long hist_value( int t_index )
+{
+    if ( t_index < HIST_LINEAR )
+        return t_index;
+    int l_exp = ( t_index - HIST_LINEAR ) / HIST_SUB + 4;
+    int l_sub = ( t_index - HIST_LINEAR ) % HIST_SUB;
+    return ( long ) ( HIST_SUB + l_sub ) << ( l_exp - 3 );
+}
+
+void hist_add( Histogram *t_hist, long t_us )
+{
+    t_hist->count++;
+    t_hist->sum += t_us;
+    t_hist->max = std::max( t_hist->max, t_us );
+    t_hist->buckets[ hist_index( t_us ) ]++;
+}
+
+void hist_merge( Histogram *t_to, const Histogram *t_from )
+{
+    t_to->count += t_from->count;
+    t_to->sum += t_from->sum;
+    t_to->max = std::max( t_to->max, t_from->max );
+    for ( int i = 0; i < HIST_BUCKETS; i++ )
+        t_to->buckets[ i ] += t_from->buckets[ i ];
+}
+
+// Upper bound of the bucket holding the t_pct percentile, in ms
+double hist_pct( const Histogram *t_hist, double t_pct )
+{
+    if ( !t_hist->count )
+        return 0;
+    long l_rank = ( long ) ( t_hist->count * t_pct / 100.0 + 0.5 );
+    long l_seen = 0;
+    for ( int i = 0; i < HIST_BUCKETS; i++ )
+    {
+        l_seen += t_hist->buckets[ i ];
+        if ( l_seen >= l_rank && t_hist->buckets[ i ] )
+            return std::min( hist_value( i + 1 ) - 1, t_hist->max ) / 1000.0;
+    }
+    return t_hist->max / 1000.0;
+}
+
+double hist_mean( const Histogram *t_hist )
+{
+    return t_hist->count ? t_hist->sum / 1000.0 / t_hist->count : 0;
+}
+
+//***************************************************************************
+// benchmark
+//
+// All clients live in this process, so the CLOCK_MONOTONIC time a sender
+// puts into a message is valid for every recipient. Every thread has its
+// own epoll set and its own share of the clients and of the rate.
+
+struct BenchClient
+{
+    int sock;
+    bool lost;                          // closed by the server or a frame was cut
+    std::string input;                  // start of an incomplete frame
+};
+
+struct BenchThread
+{
+    pthread_t thread;
+    int epoll;
+    std::vector< BenchClient * > clients;
+    double rate;                        // messages per second of this thread
+    long sent_public;
+    long sent_private;
+    long send_failed;                   // socket buffer full, message skipped
+    Histogram pub;                      // delivery latency of public messages
+    Histogram priv;                     // and of private ones
+};
+
+int g_bench = 0;
+int g_bench_clients = BENCH_CLIENTS;
+double g_bench_rate = BENCH_RATE;
+int g_bench_seconds = BENCH_SECONDS;
+int g_bench_private = BENCH_PRIVATE;
+int g_bench_threads = BENCH_THREADS;
+int g_bench_size = 0;                   // bytes added to every message
+
+std::vector< std::string > g_bench_names;
+long g_bench_start;                     // us, sending starts
+long g_bench_stop;                      // us, sending stops
+long g_bench_end;                       // us, threads stop reading
+std::atomic< bool > g_bench_quit( false );
+
+long now_us()
+{
+    timespec l_ts;
+    clock_gettime( CLOCK_MONOTONIC, &l_ts );
+    return l_ts.tv_sec * 1000000L + l_ts.tv_nsec / 1000;
+}
+
+void raise_file_limit()
+{
+    rlimit l_limit;
+    if ( getrlimit( RLIMIT_NOFILE, &l_limit ) == 0 && l_limit.rlim_cur < l_limit.rlim_max )
+    {
+        l_limit.rlim_cur = l_limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &l_limit );
+    }
+}
+
+// Connects and answers the username prompt, -1 on failure
+int bench_connect( sockaddr_in *t_addr, const char *t_name )
+{
+    int l_sock = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( l_sock < 0 )
+        return -1;
+    if ( connect( l_sock, ( sockaddr * ) t_addr, sizeof( *t_addr ) ) < 0 )
+    {
+        close( l_sock );
+        return -1;
+    }
+
+    // the prompt ends with ": " and a zero byte
+    char l_prompt[ 64 ];
+    int l_len = read( l_sock, l_prompt, sizeof( l_prompt ) );
+    if ( l_len <= 0 )
+    {
+        close( l_sock );
+        return -1;
+    }
+
+    std::string l_hello = std::string( STR_BINARY ) + t_name + "\n";
+    if ( write( l_sock, l_hello.data(), l_hello.size() ) != ( ssize_t ) l_hello.size() )
+    {
+        close( l_sock );
+        return -1;
+    }
+
+    int l_opt = 1;
+    setsockopt( l_sock, IPPROTO_TCP, TCP_NODELAY, &l_opt, sizeof( l_opt ) );
+    fcntl( l_sock, F_SETFL, fcntl( l_sock, F_GETFL ) | O_NONBLOCK );
+    return l_sock;
+}
+
+void bench_send( BenchThread *t_thread, unsigned int *t_seed )
+{
+    BenchClient *l_from = t_thread->clients[ rand_r( t_seed ) % t_thread->clients.size() ];
+    if ( l_from->lost )
+    {
+        t_thread->send_failed++;
+        return;
+    }
+    bool l_private = ( int ) ( rand_r( t_seed ) % 100 ) < g_bench_private;
+
+    char l_stamp[ 64 ];
+    snprintf( l_stamp, sizeof( l_stamp ), STR_BENCH "%ld ", now_us() );
+    std::string l_text;
+    if ( l_private )
+        l_text = "#" + g_bench_names[ rand_r( t_seed ) % g_bench_names.size() ] + " ";
+    l_text += l_stamp;
+    l_text.append( g_bench_size, 'x' );
+
+    FrameHeader l_head = { FRAME_MESSAGE, { 0, 0, 0 }, htonl( l_text.size() ), 0 };
+    iovec l_iov[ 2 ] = { { &l_head, sizeof( l_head ) }, { ( void * ) l_text.data(), l_text.size() } };
+    msghdr l_msg = {};
+    l_msg.msg_iov = l_iov;
+    l_msg.msg_iovlen = 2;
+    ssize_t l_len = sendmsg( l_from->sock, &l_msg, MSG_NOSIGNAL );
+    if ( l_len != ( ssize_t ) ( sizeof( l_head ) + l_text.size() ) )
+    {
+        // the rest of a cut frame would be taken for a new one, the client is lost
+        if ( l_len > 0 )
+        {
+            log_msg( LOG_INFO, "Frame cut by a full socket buffer, client closed." );
+            shutdown( l_from->sock, SHUT_WR );
+            l_from->lost = true;
+        }
+        t_thread->send_failed++;
+        return;
+    }
+
+    if ( l_private )
+        t_thread->sent_private++;
+    else
+        t_thread->sent_public++;
+}
+
+// Parses complete frames and records the latency of benchmark messages
+bool bench_receive( BenchThread *t_thread, BenchClient *t_client )
+{
+    char l_buf[ 65536 ];
+    int l_len = read( t_client->sock, l_buf, sizeof( l_buf ) );
+    if ( l_len < 0 && ( errno == EAGAIN || errno == EINTR ) )
+        return true;
+    if ( l_len <= 0 )
+        return false;
+    long l_now = now_us();
+    t_client->input.append( l_buf, l_len );
+
+    size_t l_off = 0;
+    while ( t_client->input.size() - l_off >= sizeof( FrameHeader ) )
+    {
+        FrameHeader l_head;
+        memcpy( &l_head, t_client->input.data() + l_off, sizeof( l_head ) );
+        size_t l_size = ntohl( l_head.length );
+        if ( t_client->input.size() - l_off < sizeof( l_head ) + l_size )
+            break;
+
+        // "name: bench <us> ..." or "name:  bench <us> ..." when private
+        std::string l_text = t_client->input.substr( l_off + sizeof( l_head ), l_size );
+        size_t l_pos = l_text.find( STR_BENCH );
+        long l_sent;
+        if ( l_pos != std::string::npos && sscanf( l_text.c_str() + l_pos + strlen( STR_BENCH ), "%ld", &l_sent ) == 1
+             && l_sent >= g_bench_start )
+            hist_add( l_head.type == FRAME_PRIVATE ? &t_thread->priv : &t_thread->pub, l_now - l_sent );
+        l_off += sizeof( l_head ) + l_size;
+    }
+    t_client->input.erase( 0, l_off );
+    return true;
+}
+
+void *bench_loop( void *t_arg )
+{
+    BenchThread *l_thread = ( BenchThread * ) t_arg;
+    unsigned int l_seed = time( nullptr ) ^ ( uintptr_t ) l_thread;
+    epoll_event l_events[ EPOLL_EVENTS ];
+    double l_interval = l_thread->rate > 0 ? 1000000.0 / l_thread->rate : 0;
+    double l_due = g_bench_start;
+
+    while ( !g_bench_quit )
+    {
+        long l_now = now_us();
+        if ( l_now >= g_bench_end )
+            break;
+
+        // sends what is due, the schedule does not slip when a wait was long
+        while ( l_interval > 0 && l_due <= l_now && l_due < g_bench_stop )
+        {
+            bench_send( l_thread, &l_seed );
+            l_due += l_interval;
+        }
+
+        long l_wait = g_bench_end - l_now;
+        if ( l_interval > 0 && l_due < g_bench_stop )
+            l_wait = std::min( l_wait, ( long ) l_due - l_now );
+        int l_count = epoll_wait( l_thread->epoll, l_events, EPOLL_EVENTS, ( int ) ( ( l_wait + 999 ) / 1000 ) );
+        for ( int i = 0; i < l_count; i++ )
+        {
+            BenchClient *l_client = ( BenchClient * ) l_events[ i ].data.ptr;
+            if ( !bench_receive( l_thread, l_client ) )
+            {
+                log_msg( LOG_INFO, "Server closed a connection." );
+                epoll_ctl( l_thread->epoll, EPOLL_CTL_DEL, l_client->sock, nullptr );
+                l_client->lost = true;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void bench_report( std::vector< BenchThread > &t_threads, long t_connect_us )
+{
+    long l_public = 0, l_private = 0, l_failed = 0;
+    Histogram l_pub = {}, l_priv = {};
+    for ( BenchThread &l_thread : t_threads )
+    {
+        l_public += l_thread.sent_public;
+        l_private += l_thread.sent_private;
+        l_failed += l_thread.send_failed;
+        hist_merge( &l_pub, &l_thread.pub );
+        hist_merge( &l_priv, &l_thread.priv );
+    }
+
+    double l_seconds = ( g_bench_stop - g_bench_start ) / 1000000.0;
+    long l_expected = l_public * g_bench_clients + l_private;
+    printf( "clients: %d  connected in %.3f s\n", g_bench_clients, t_connect_us / 1000000.0 );
+    printf( "sent: %ld public, %ld private, %ld skipped, %.1f messages/s\n",
+            l_public, l_private, l_failed, ( l_public + l_private ) / l_seconds );
+    printf( "delivered: %ld of %ld, %.1f deliveries/s\n",
+            l_pub.count + l_priv.count, l_expected, ( l_pub.count + l_priv.count ) / l_seconds );
+    printf( "latency ms      count     mean      p50      p90      p99    p99.9      max\n" );
+    const char *l_names[] = { "public", "private" };
+    Histogram *l_hists[] = { &l_pub, &l_priv };
+    for ( int i = 0; i < 2; i++ )
+        printf( "%-10s %10ld %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", l_names[ i ], l_hists[ i ]->count,
+                hist_mean( l_hists[ i ] ), hist_pct( l_hists[ i ], 50 ), hist_pct( l_hists[ i ], 90 ),
+                hist_pct( l_hists[ i ], 99 ), hist_pct( l_hists[ i ], 99.9 ), l_hists[ i ]->max / 1000.0 );
+}
+
+int bench_run( sockaddr_in *t_addr )
+{
+    raise_file_limit();
+    if ( g_bench_threads > g_bench_clients )
+        g_bench_threads = g_bench_clients;
+
+    std::vector< BenchThread > l_threads( g_bench_threads );
+    for ( BenchThread &l_thread : l_threads )
+    {
+        l_thread.epoll = epoll_create1( EPOLL_CLOEXEC );
+        l_thread.rate = g_bench_rate / g_bench_threads;
+        l_thread.sent_public = l_thread.sent_private = l_thread.send_failed = 0;
+        l_thread.pub = Histogram();
+        l_thread.priv = Histogram();
+    }
+
+    log_msg( LOG_INFO, "Connecting %d clients...", g_bench_clients );
+    long l_started = now_us();
+    std::vector< BenchClient > l_clients( g_bench_clients );
+    for ( int i = 0; i < g_bench_clients; i++ )
+    {
+        char l_name[ 64 ];
+        snprintf( l_name, sizeof( l_name ), "b%d_%d", getpid(), i );
+        l_clients[ i ].sock = bench_connect( t_addr, l_name );
+        l_clients[ i ].lost = false;
+        if ( l_clients[ i ].sock < 0 )
+        {
+            log_msg( LOG_ERROR, "Unable to connect client %d.", i );
+            exit( 1 );
+        }
+        g_bench_names.push_back( l_name );
+
+        BenchThread &l_thread = l_threads[ i % g_bench_threads ];
+        l_thread.clients.push_back( &l_clients[ i ] );
+        epoll_event l_ev;
+        l_ev.events = EPOLLIN;
+        l_ev.data.ptr = &l_clients[ i ];
+        epoll_ctl( l_thread.epoll, EPOLL_CTL_ADD, l_clients[ i ].sock, &l_ev );
+    }
+    long l_connect = now_us() - l_started;
+
+    g_bench_start = now_us() + BENCH_SETTLE_MS * 1000L;
+    g_bench_stop = g_bench_start + g_bench_seconds * 1000000L;
+    g_bench_end = g_bench_stop + BENCH_DRAIN_MS * 1000L;
+    log_msg( LOG_INFO, "Sending %.0f messages/s for %d s...", g_bench_rate, g_bench_seconds );
+
+    for ( BenchThread &l_thread : l_threads )
+    {
+        if ( pthread_create( &l_thread.thread, nullptr, bench_loop, &l_thread ) != 0 )
+        {
+            log_msg( LOG_ERROR, "Unable to create thread." );
+            exit( 1 );
+        }
+    }
+    for ( BenchThread &l_thread : l_threads )
+        pthread_join( l_thread.thread, nullptr );
+
+    bench_report( l_threads, l_connect );
+    for ( BenchClient &l_client : l_clients )
+        close( l_client.sock );
+    return 0;
+}
+
 //***************************************************************************
 // help
 
@@ -83,10 +498,19 @@ void help( int t_narg, char **t_args )
             "  Socket client example.\n"
             "\n"
             "  Use: %s [-h -d] ip_or_name port_number\n"
+            "       %s -B [-c clients -r rate -n seconds -p percent -t threads -s bytes] ip_or_name port_number\n"
             "\n"
             "    -d  debug mode \n"
             "    -h  this help\n"
-            "\n", t_args[ 0 ] );
+            "    -B  benchmark, prints throughput and delivery latency\n"
+            "    -c  connected clients (default %d)\n"
+            "    -r  messages per second from all clients (default %d)\n"
+            "    -n  seconds of sending (default %d)\n"
+            "    -p  percent of private messages (default %d)\n"
+            "    -t  threads (default %d)\n"
+            "    -s  bytes added to every message (default 0)\n"
+            "\n", t_args[ 0 ], t_args[ 0 ], BENCH_CLIENTS, BENCH_RATE, BENCH_SECONDS,
+            BENCH_PRIVATE, BENCH_THREADS );
 
         exit( 0 );
     }
@@ -114,6 +538,20 @@ int main( int t_narg, char **t_args )
         if ( !strcmp( t_args[ i ], "-h" ) )
             help( t_narg, t_args );
 
+        if ( !strcmp( t_args[ i ], "-B" ) )
+            g_bench = 1;
+
+        // benchmark options with a value
+        if ( i + 1 < t_narg )
+        {
+            if ( !strcmp( t_args[ i ], "-c" ) ) { g_bench_clients = atoi( t_args[ ++i ] ); continue; }
+            if ( !strcmp( t_args[ i ], "-r" ) ) { g_bench_rate = atof( t_args[ ++i ] ); continue; }
+            if ( !strcmp( t_args[ i ], "-n" ) ) { g_bench_seconds = atoi( t_args[ ++i ] ); continue; }
+            if ( !strcmp( t_args[ i ], "-p" ) ) { g_bench_private = atoi( t_args[ ++i ] ); continue; }
+            if ( !strcmp( t_args[ i ], "-t" ) ) { g_bench_threads = atoi( t_args[ ++i ] ); continue; }
+            if ( !strcmp( t_args[ i ], "-s" ) ) { g_bench_size = atoi( t_args[ ++i ] ); continue; }
+        }
+
         if ( *t_args[ i ] != '-' )
         {
             if ( !l_host )
@@ -148,6 +586,16 @@ int main( int t_narg, char **t_args )
     l_cl_addr.sin_port = htons( l_port );
     freeaddrinfo( l_ai_ans );
 
+    if ( g_bench )
+    {
+        if ( g_bench_clients <= 0 || g_bench_threads <= 0 || g_bench_seconds <= 0 || g_bench_size < 0 )
+        {
+            log_msg( LOG_INFO, "Wrong benchmark parameters!" );
+            help( 1, t_args );
+        }
+        return bench_run( &l_cl_addr );
+    }
+
     // socket creation
     int l_sock_server = socket( AF_INET, SOCK_STREAM, 0 );
     if ( l_sock_server == -1 )
@@ -10,25 +10,328 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 #include <algorithm>
 
+struct Connection;
+
 struct ClientInfo {
     int socket;
     char* username;
+    Connection* conn;
+    int id;
+    bool used;
 };
 
 #define NUM_OF_CLIENTS 20
 #define BUFFER_SIZE 256
+#define DEFAULT_REACTORS 4
+#define EPOLL_EVENTS 64
+#define WRITE_IOVECS 64
+#define DEFAULT_OUT_BUDGET (256 * 1024)
+#define DEFAULT_HANDSHAKE_MS 10000
+#define MAX_FRAME (1024 * 1024)
+#define READ_CHUNK 65536
+#define TABLE_CHUNK 1024
+#define TABLE_CHUNKS 1024
+#define DIRECTORY_SHARDS 64
+#define MAX_ROOMS 4096
+#define ROOM_NAME_MAX 64                // bytes, the log keeps the length in 16 bits
+#define DEFAULT_RING 50
+#define LOG_SEGMENT (16 * 1024 * 1024)
+#define LOG_QUEUE_MAX 65536
+#define HISTORY_MAX 1000
+#define HISTORY_SEGMENTS 4              // scanned at most by one #history
+#define DEFAULT_LOG_KEEP 64             // segments kept on disk
+#define METRIC_BUCKETS 40
+#define METRICS_WAIT_MS 100
+#define LOG_RATE 200                    // lines per second and thread
+#define LOG_BURST 1000
 
 #define STR_CLOSE "#close"
 #define STR_QUIT "#close"
 #define STR_LIST "#list"
+#define STR_JOIN "#join "
+#define STR_LEAVE "#leave "
+#define STR_ROOMS "#rooms"
+#define STR_HISTORY "#history"
+#define STR_METRICS "#metrics"
+#define STR_STATS "#stats"
+#define STR_PROMPT "Enter a username: "
+#define STR_BINARY "#binary "
+
+// Table of connected clients indexed by id. Slots are allocated in chunks
+// that never move, so a ClientInfo* stays valid while the table grows, and
+// the ids of clients that left are reused.
+struct ClientTable {
+    pthread_mutex_t lock;
+    std::atomic<ClientInfo*> chunks[TABLE_CHUNKS];
+    std::vector<int> free_ids;
+    int next_id;
+};
+
+// Part of the username directory, a name hashes to one shard
+struct DirectoryShard {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, int> ids;
+};
+
+ClientTable client_table;
+DirectoryShard directory[DIRECTORY_SHARDS];
+
+struct Message;
+struct Room;
+
+// Text of #list, rebuilt only when somebody joined or left since
+pthread_mutex_t list_lock;
+Message* list_cache = nullptr;
+Message* list_frame = nullptr;
+unsigned long list_cache_version = 0;
+std::atomic<unsigned long> list_version(1);
+
+pthread_mutex_t rooms_lock;
+std::unordered_map<std::string, Room*> rooms;
+long rooms_reported_at;                 // ms, main thread only
+
+// Message waiting for the log thread
+struct LogEntry {
+    Room* room;
+    Message* text;
+    long time;
+};
+
+// #history waiting for the log thread
+struct HistoryRequest {
+    Connection* conn;
+    std::string room;
+    size_t count;
+};
+
+// Texts found for a #history, handed back to the reactor of the client
+struct HistoryAnswer {
+    Connection* conn;
+    std::vector<std::string> texts;
+};
+
+// Record of the log file, followed by the room name and the text
+struct LogRecord {
+    uint32_t length;                    // text bytes
+    uint16_t room_length;
+    uint16_t reserved;
+    int64_t time;                       // ms since the epoch
+};
+
+size_t ring_size = DEFAULT_RING;
+const char* log_dir = nullptr;
+pthread_t log_thread;
+pthread_mutex_t log_lock;
+pthread_cond_t log_cond;
+std::vector<LogEntry> log_queue;
+std::vector<HistoryRequest> log_requests;
+bool log_quit = false;
+int log_fd = -1;
+long log_size = 0;                      // bytes in the current segment
+int log_first = 0;                      // oldest segment on disk, log thread only
+int log_keep = DEFAULT_LOG_KEEP;
+std::atomic<int> log_segment(0);        // segment being written
+std::atomic<long> log_dropped(0);
+
+struct Reactor;
+
+// Message built once and shared by all its recipients, immutable after
+// creation and freed by whoever drops the last reference
+struct Message {
+    std::atomic<int> refs;
+    size_t length;
+    char data[];
+};
+
+// Binary protocol, chosen by answering the prompt with "#binary name\n".
+// From then on both directions send frames, a header in network byte order
+// followed by the payload, any number of them in one segment.
+enum FrameType {
+    FRAME_MESSAGE = 1,                  // chat line or command, both directions
+    FRAME_PRIVATE = 2,                  // private message for this client
+    FRAME_LIST = 3                      // reply to #list, "Client: name" lines
+};
+
+struct FrameHeader {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t length;                    // payload bytes, at most MAX_FRAME
+    uint32_t sender;                    // client id + 1, 0 for the server
+};
+
+// The same message for legacy text clients and for binary ones
+struct Outgoing {
+    Message* text;
+    Message* frame;
+};
 
-// Shared list of client sockets and mutex for synchronization
-std::vector<ClientInfo> client_sockets;
-pthread_mutex_t lock;
+// Reference to a message in the outbound queue of one recipient
+struct OutNode {
+    OutNode* next;
+    Message* msg;
+    bool reply;                         // answer to the client's own request
+};
+
+// Message taken from the inbox, replies do not count against the budget
+struct Queued {
+    Message* msg;
+    bool reply;
+};
+
+// Connected client, served by one reactor thread. Other threads only push
+// into inbox and schedule the connection, everything else belongs to the
+// reactor that owns it.
+struct Connection {
+    int socket;
+    char* username;                     // nullptr until the handshake ends
+    int id;                             // slot in client_table
+    int port;
+    Reactor* reactor;
+    char* hello;                        // username read so far, nullptr after the handshake
+    int hello_len;
+    size_t handshake_index;             // position in reactor->handshakes
+    long deadline;                      // ms, end of the handshake
+    bool binary;                        // speaks frames instead of text
+    std::string input;                  // start of an incomplete frame
+    size_t skip;                        // rest of a refused frame still to read
+    std::vector<Room*> rooms;           // joined rooms
+    Room* room;                         // where public messages go, nullptr for everybody
+    int history_pending;                // #history at the log thread, reactor only
+    std::atomic<OutNode*> inbox;        // lock-free stack, newest first
+    std::atomic<bool> scheduled;        // already on the ready list of the reactor
+    Connection* ready_next;
+    std::deque<Queued> pending;         // taken from inbox, oldest first
+    size_t pending_offset;              // bytes of pending.front() already sent
+    std::atomic<long> queued;           // bytes in inbox and pending, without replies
+    long replies;                       // reply bytes queued, reactor only
+    std::atomic<long> dropped;          // bytes lost because the client is slow
+    std::atomic<bool> overflow;         // over budget with DISCONNECT_SLOW
+    bool want_out;                      // EPOLLOUT is on
+    bool want_in;                       // EPOLLIN is on, off while replies exceed the budget
+    bool closed;
+};
+
+// Immutable array of the connections of one reactor, read by broadcasts
+struct Members {
+    size_t count;
+    Connection* conns[];
+};
+
+// Chat room, a post reaches its subscribers only. Joins and leaves change
+// the private list under the lock of the room, the array read by posts is
+// republished at most once per reactor loop, like the members of a reactor.
+struct Room {
+    std::string name;
+    pthread_mutex_t lock;
+    std::vector<Connection*> subscribers;
+    bool changed;                       // subscribers differ from members
+    std::atomic<Members*> members;      // published for posts
+    std::atomic<long> messages;
+    std::atomic<long> bytes;
+    long reported;                      // messages at the last #rooms
+    pthread_mutex_t history_lock;
+    std::vector<Outgoing> ring;         // last messages, replayed to joiners
+    size_t ring_start;                  // oldest message once the ring is full
+};
+
+Room lobby;                             // history of messages for everybody
+
+// Old member array and connections that left, freed after a grace period
+struct Retired {
+    Members* list;
+    std::vector<Connection*> conns;
+    std::vector<unsigned long> states;
+};
+
+// Event loop thread that owns a shard of the connections. The accepting
+// thread hands new connections over round-robin through the queue and
+// wakes the reactor with its eventfd.
+struct Reactor {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;
+    pthread_mutex_t queue_lock;
+    std::vector<Connection*> queue;
+    int clients;                        // touched only by the reactor thread
+    std::atomic<Connection*> ready;     // connections with new outbound messages
+    std::atomic<unsigned long> rcu_state; // odd while the reactor reads shared lists
+    std::vector<Connection*> shard;     // private copy of the members
+    bool shard_changed;
+    std::vector<Connection*> leaving;   // removed from shard, not yet published
+    std::atomic<Members*> members;      // published for broadcasts
+    std::vector<Retired> retired;
+    std::vector<Room*> rooms_changed;   // rooms to republish in this loop
+    std::vector<std::pair<Connection*, Room*>> replays; // joiners waiting for history
+    std::vector<Connection*> handshakes; // connections without a username yet
+    long handshake_due;                 // earliest deadline among them
+    pthread_mutex_t answers_lock;
+    std::vector<HistoryAnswer> answers; // from the log thread
+    std::vector<Connection*> lingering; // closed, freed once their #history is answered
+};
+
+std::vector<Reactor*> reactors;
+size_t next_reactor = 0;
+
+// What happens when a client does not read fast enough
+enum SlowPolicy {
+    DROP_OLDEST,                        // queued messages make room for new ones
+    DROP_NEWEST,                        // new messages are not queued
+    DISCONNECT_SLOW
+};
+
+long out_budget = DEFAULT_OUT_BUDGET;   // bytes queued for one client
+long handshake_ms = DEFAULT_HANDSHAKE_MS;
+SlowPolicy out_policy = DROP_OLDEST;
+thread_local Reactor* current_reactor = nullptr;
+
+// Histogram with power of two buckets, bucket i counts values below 2^i
+struct MetricHistogram {
+    std::atomic<long> count;
+    std::atomic<long> sum;
+    std::atomic<long> buckets[METRIC_BUCKETS];
+};
+
+// Counters of one thread. Only the thread itself writes them, without
+// read-modify-write, and a scrape sums the counters of all threads.
+struct Metrics {
+    std::atomic<long> clients;          // with a username, gauge
+    std::atomic<long> handshakes;       // waiting for a username, gauge
+    std::atomic<long> messages_in;
+    std::atomic<long> bytes_in;
+    std::atomic<long> messages_out;     // written to sockets
+    std::atomic<long> bytes_out;
+    std::atomic<long> fanouts;          // broadcasts and room posts
+    std::atomic<long> recipients;
+    std::atomic<long> dropped_messages;
+    std::atomic<long> dropped_bytes;
+    std::atomic<long> slow_disconnects;
+    MetricHistogram fanout_us;          // time to queue a message for everybody
+    MetricHistogram queue_bytes;        // queued for a client when it is flushed
+};
+
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Metrics*> all_metrics;
+thread_local Metrics* thread_metrics = nullptr;
+int metrics_socket = -1;
 
 //***************************************************************************
 // log messages
@@ -38,6 +341,39 @@ pthread_mutex_t lock;
 
 int g_debug = LOG_INFO;
 
+// Formatted line waiting for the logger thread
+struct LogLine {
+    LogLine* next;
+    int level;
+    char text[];
+};
+
+std::atomic<LogLine*> logger_lines(nullptr); // lock-free stack, newest first
+std::atomic<long> logger_suppressed(0);
+int logger_wake = -1;
+pthread_t logger_thread;
+std::atomic<bool> logger_quit(false);
+
+long now_ms();
+
+// Token bucket of the calling thread, errors are never suppressed
+bool log_allowed(int t_log_level) {
+    thread_local double tokens = LOG_BURST;
+    thread_local long refilled = 0;
+    if (t_log_level == LOG_ERROR)
+        return true;
+    long now = now_ms();
+    tokens = std::min((double)LOG_BURST, tokens + (now - refilled) * LOG_RATE / 1000.0);
+    refilled = now;
+    if (tokens < 1) {
+        logger_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    tokens--;
+    return true;
+}
+
+// Formats the line and leaves the output to the logger thread
 void log_msg(int t_log_level, const char *t_form, ...) {
     const char *out_fmt[] = {
         "ERR: (%d-%s) %s\n",
@@ -45,115 +381,1608 @@ void log_msg(int t_log_level, const char *t_form, ...) {
         "DEB: %s\n"};
     if (t_log_level && t_log_level > g_debug)
         return;
+    int l_errno = errno;
+    if (!log_allowed(t_log_level))
+        return;
     char l_buf[1024];
     va_list l_arg;
     va_start(l_arg, t_form);
-    vsprintf(l_buf, t_form, l_arg);
+    vsnprintf(l_buf, sizeof(l_buf), t_form, l_arg);
     va_end(l_arg);
-    switch (t_log_level) {
-    case LOG_INFO:
-    case LOG_DEBUG:
-        fprintf(stdout, out_fmt[t_log_level], l_buf);
-        break;
-    case LOG_ERROR:
-        fprintf(stderr, out_fmt[t_log_level], errno, strerror(errno), l_buf);
-        break;
+
+    char l_line[1200];
+    int l_len = t_log_level == LOG_ERROR
+        ? snprintf(l_line, sizeof(l_line), out_fmt[t_log_level], l_errno, strerror(l_errno), l_buf)
+        : snprintf(l_line, sizeof(l_line), out_fmt[t_log_level], l_buf);
+    l_len = std::min(l_len, (int)sizeof(l_line) - 1);
+    LogLine* line = (LogLine*)malloc(sizeof(LogLine) + l_len + 1);
+    line->level = t_log_level;
+    memcpy(line->text, l_line, l_len + 1);
+
+    // the logger may free the line as soon as it is pushed
+    LogLine* head = logger_lines.load();
+    do {
+        line->next = head;
+    } while (!logger_lines.compare_exchange_weak(head, line));
+    if (!head && logger_wake >= 0) {
+        uint64_t one = 1;
+        write(logger_wake, &one, sizeof(one));
+    }
+}
+
+// Prints queued lines oldest first, and with report how many were suppressed
+void logger_flush(bool report) {
+    LogLine* line = logger_lines.exchange(nullptr);
+    LogLine* fifo = nullptr;
+    while (line) {
+        LogLine* next = line->next;
+        line->next = fifo;
+        fifo = line;
+        line = next;
+    }
+    while (fifo) {
+        LogLine* next = fifo->next;
+        fputs(fifo->text, fifo->level == LOG_ERROR ? stderr : stdout);
+        free(fifo);
+        fifo = next;
+    }
+    long suppressed = report ? logger_suppressed.exchange(0) : 0;
+    if (suppressed)
+        printf("INF: %ld log lines suppressed.\n", suppressed);
+    fflush(stdout);
+    fflush(stderr);
+}
+
+void* logger_loop(void*) {
+    long reported = now_ms();
+    while (!logger_quit.load()) {
+        struct pollfd pfd = {logger_wake, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) > 0) {
+            uint64_t count;
+            read(logger_wake, &count, sizeof(count));
+        }
+        bool report = now_ms() - reported >= 1000;
+        if (report)
+            reported = now_ms();
+        logger_flush(report);
+    }
+    logger_flush(true);
+    return nullptr;
+}
+
+void logger_start() {
+    logger_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (logger_wake < 0 || pthread_create(&logger_thread, nullptr, logger_loop, nullptr) != 0) {
+        perror("Failed to start the logger");
+        exit(1);
+    }
+}
+
+void logger_stop() {
+    logger_quit.store(true);
+    uint64_t one = 1;
+    write(logger_wake, &one, sizeof(one));
+    pthread_join(logger_thread, nullptr);
+}
+
+//***************************************************************************
+// metrics
+//
+// Every thread counts into its own Metrics, so the hot path never shares a
+// cache line with another thread and never waits. Scrapes come from stdin
+// or from a local Unix socket and are answered in the Prometheus text
+// format, over HTTP when the request looks like one.
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Counters of the calling thread, created on first use
+Metrics* metrics_register() {
+    Metrics* m = new Metrics();
+    pthread_mutex_lock(&metrics_lock);
+    all_metrics.push_back(m);
+    pthread_mutex_unlock(&metrics_lock);
+    thread_metrics = m;
+    return m;
+}
+
+// Only the owning thread writes, a plain load and store is enough
+void metric_add(std::atomic<long>& counter, long value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void metric_observe(MetricHistogram& hist, long value) {
+    int index = value <= 0 ? 0 : std::min(64 - __builtin_clzl(value), METRIC_BUCKETS - 1);
+    metric_add(hist.count, 1);
+    metric_add(hist.sum, value);
+    metric_add(hist.buckets[index], 1);
+}
+
+Metrics* my_metrics() {
+    return thread_metrics ? thread_metrics : metrics_register();
+}
+
+// Sum of the counters of all threads
+void metrics_sum(Metrics& total) {
+    std::atomic<long>* to = (std::atomic<long>*)&total;
+    size_t fields = sizeof(Metrics) / sizeof(std::atomic<long>);
+    for (size_t i = 0; i < fields; i++)
+        to[i].store(0);
+    pthread_mutex_lock(&metrics_lock);
+    for (Metrics* m : all_metrics) {
+        std::atomic<long>* from = (std::atomic<long>*)m;
+        for (size_t i = 0; i < fields; i++)
+            to[i].store(to[i].load() + from[i].load(std::memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_line(std::string& out, const char* name, const char* type, const char* help, long value) {
+    char line[512];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", name, help, name, type, name, value);
+    out += line;
+}
+
+// Histogram in the unit of its buckets times scale, us to seconds with 1e-6
+void metrics_histogram(std::string& out, const char* name, const char* help,
+                       const MetricHistogram& hist, double scale) {
+    char line[512];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += line;
+    long seen = 0;
+    for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+        seen += hist.buckets[i].load();
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %ld\n", name, (double)(1L << i) * scale, seen);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %ld\n%s_sum %g\n%s_count %ld\n",
+             name, hist.count.load(), name, hist.sum.load() * scale, name, hist.count.load());
+    out += line;
+}
+
+std::string metrics_text();
+
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//***************************************************************************
+// read-copy-update
+//
+// Reactors read shared lists without locks. A reactor is online (odd state)
+// while it handles events and offline (even) while it waits in epoll_wait.
+// Memory unlinked from a shared list is freed only after every reactor was
+// offline at least once, then no reactor can hold a pointer into it.
+
+void rcu_online(Reactor* reactor) {
+    reactor->rcu_state.fetch_add(1);
+}
+
+void rcu_offline(Reactor* reactor) {
+    reactor->rcu_state.fetch_add(1);
+}
+
+std::vector<unsigned long> rcu_snapshot() {
+    std::vector<unsigned long> states;
+    for (Reactor* reactor : reactors)
+        states.push_back(reactor->rcu_state.load());
+    return states;
+}
+
+bool rcu_passed(const std::vector<unsigned long>& states) {
+    for (size_t i = 0; i < states.size(); i++) {
+        if ((states[i] & 1) && reactors[i]->rcu_state.load() == states[i])
+            return false;
+    }
+    return true;
+}
+
+//***************************************************************************
+// broadcast membership
+//
+// Every reactor publishes an array of its own connections. Only the owner
+// changes it, once per loop at most, so joins and leaves take no lock and
+// a burst of them costs one copy. Broadcasts read the arrays of all
+// reactors and never wait for a join or leave.
+
+void members_join(Reactor* reactor, Connection* conn) {
+    reactor->shard.push_back(conn);
+    reactor->shard_changed = true;
+}
+
+void members_leave(Reactor* reactor, Connection* conn) {
+    auto it = std::find(reactor->shard.begin(), reactor->shard.end(), conn);
+    if (it != reactor->shard.end()) {
+        *it = reactor->shard.back();
+        reactor->shard.pop_back();
+    }
+    reactor->leaving.push_back(conn);
+    reactor->shard_changed = true;
+}
+
+Members* members_copy(const std::vector<Connection*>& conns) {
+    size_t count = conns.size();
+    Members* list = (Members*)malloc(sizeof(Members) + count * sizeof(Connection*));
+    list->count = count;
+    if (count)
+        memcpy(list->conns, conns.data(), count * sizeof(Connection*));
+    return list;
+}
+
+void members_publish(Reactor* reactor) {
+    if (!reactor->shard_changed)
+        return;
+    Retired item;
+    item.list = reactor->members.exchange(members_copy(reactor->shard));
+    item.conns.swap(reactor->leaving);
+    item.states = rcu_snapshot();
+    reactor->retired.push_back(item);
+    reactor->shard_changed = false;
+}
+
+//***************************************************************************
+// outbound messages
+
+Message* message_alloc(size_t length) {
+    Message* msg = (Message*)malloc(sizeof(Message) + length);
+    new (&msg->refs) std::atomic<int>(1);
+    msg->length = length;
+    return msg;
+}
+
+Message* message_new(const char* text, size_t length) {
+    Message* msg = message_alloc(length);
+    memcpy(msg->data, text, length);
+    return msg;
+}
+
+// Frame with the text as payload, without its final newline
+Message* message_frame(int type, uint32_t sender, const std::string& text) {
+    size_t length = text.size();
+    if (length && text[length - 1] == '\n')
+        length--;
+    FrameHeader header = {(uint8_t)type, {0, 0, 0}, htonl(length), htonl(sender)};
+    Message* msg = message_alloc(sizeof(header) + length);
+    memcpy(msg->data, &header, sizeof(header));
+    memcpy(msg->data + sizeof(header), text.data(), length);
+    return msg;
+}
+
+void message_unref(Message* msg) {
+    if (msg->refs.fetch_sub(1) == 1)
+        free(msg);
+}
+
+void reactor_wake(Reactor* reactor) {
+    uint64_t one = 1;
+    write(reactor->wake_fd, &one, sizeof(one));
+}
+
+void count_drop(Connection* conn, size_t length) {
+    conn->dropped.fetch_add(length);
+    Metrics* m = my_metrics();
+    metric_add(m->dropped_bytes, length);
+    metric_add(m->dropped_messages, 1);
+}
+
+// Pushes the message onto the inbox and schedules the connection
+void send_push(Connection* conn, Message* msg, bool reply) {
+    if (msg) {
+        msg->refs.fetch_add(1);
+        OutNode* node = new OutNode;
+        node->msg = msg;
+        node->reply = reply;
+        node->next = conn->inbox.load();
+        while (!conn->inbox.compare_exchange_weak(node->next, node))
+            ;
+    }
+
+    if (conn->scheduled.exchange(true))
+        return;
+    Reactor* reactor = conn->reactor;
+    Connection* head = reactor->ready.load();
+    do {
+        conn->ready_next = head;
+    } while (!reactor->ready.compare_exchange_weak(head, conn));
+
+    // the owner drains its ready list before it sleeps again
+    if (!head && reactor != current_reactor)
+        reactor_wake(reactor);
+}
+
+// Queues the message for the client, never blocks. The reactor owning the
+// connection writes it out. The byte budget is checked here, with
+// DROP_OLDEST the owner trims the queue and twice the budget is the hard cap.
+void send_to(Connection* conn, Message* msg) {
+    long limit = out_policy == DROP_OLDEST ? 2 * out_budget : out_budget;
+    long length = msg->length;
+    // one message always fits an empty queue, however long it is
+    long before = conn->queued.fetch_add(length);
+    if (before > 0 && before + length > limit) {
+        conn->queued.fetch_sub(length);
+        count_drop(conn, length);
+        if (out_policy != DISCONNECT_SLOW || conn->overflow.exchange(true))
+            return;
+        msg = nullptr;
     }
+    send_push(conn, msg, false);
 }
 
+// Answer to a request of the client, queued by its own reactor. Replies
+// are never dropped and do not make the client look slow, instead the
+// reactor stops reading requests while they exceed the budget.
+void send_reply(Connection* conn, Message* msg) {
+    conn->replies += msg->length;
+    send_push(conn, msg, true);
+}
+
+Outgoing outgoing_new(int type, uint32_t sender, const std::string& text) {
+    Outgoing out;
+    out.text = message_new(text.data(), text.size());
+    out.frame = message_frame(type, sender, text);
+    return out;
+}
+
+void outgoing_unref(const Outgoing& out) {
+    message_unref(out.text);
+    message_unref(out.frame);
+}
+
+void send_out(Connection* conn, const Outgoing& out) {
+    send_to(conn, conn->binary ? out.frame : out.text);
+}
+
+void reply_out(Connection* conn, const Outgoing& out) {
+    send_reply(conn, conn->binary ? out.frame : out.text);
+}
+
+void history_add(Room* room, const Outgoing& out);
+
 // Broadcast message to all connected clients
-void broadcast_to_clients(const char *message) {
-    pthread_mutex_lock(&lock);
-    for (const ClientInfo& client : client_sockets) {
-        write(client.socket, message, strlen(message));
-    }
-    pthread_mutex_unlock(&lock);
-}
-
-// Handle client communication
-void* handle_client(void *client_socket_ptr) {
-    int client_socket = *(int*)client_socket_ptr;
-    free(client_socket_ptr);
-    char buffer[BUFFER_SIZE];
-
-    // Find the client info in the vector
-    ClientInfo* client_info = nullptr;
-    pthread_mutex_lock(&lock);
-    for (ClientInfo& client : client_sockets) {
-        if (client.socket == client_socket) {
-            client_info = &client;
-            break;
+void broadcast_to_clients(uint32_t sender, const std::string& text) {
+    long started = now_us();
+    Outgoing out = outgoing_new(FRAME_MESSAGE, sender, text);
+    history_add(&lobby, out);
+    long count = 0;
+    for (Reactor* reactor : reactors) {
+        Members* list = reactor->members.load();
+        for (size_t i = 0; list && i < list->count; i++) {
+            send_out(list->conns[i], out);
         }
+        count += list ? list->count : 0;
     }
-    pthread_mutex_unlock(&lock);
+    outgoing_unref(out);
+
+    Metrics* m = my_metrics();
+    metric_add(m->fanouts, 1);
+    metric_add(m->recipients, count);
+    metric_observe(m->fanout_us, now_us() - started);
+}
 
-    if (!client_info) {
-        log_msg(LOG_ERROR, "Client info not found for socket %d", client_socket);
-        close(client_socket);
-        return nullptr;
+void set_events(Connection* conn, bool want_out) {
+    bool want_in = conn->replies <= out_budget;
+    if (conn->want_out == want_out && conn->want_in == want_in)
+        return;
+    struct epoll_event ev;
+    ev.events = (want_in ? EPOLLIN : 0) | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->socket, &ev);
+    conn->want_out = want_out;
+    conn->want_in = want_in;
+}
+
+// Writes queued messages with writev, returns false when the client is gone
+bool flush_client(Connection* conn) {
+    OutNode* node = conn->inbox.exchange(nullptr);
+    OutNode* fifo = nullptr;
+    while (node) {
+        OutNode* next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
+    while (fifo) {
+        OutNode* next = fifo->next;
+        conn->pending.push_back({fifo->msg, fifo->reply});
+        delete fifo;
+        fifo = next;
+    }
+
+    if (conn->overflow.load()) {
+        log_msg(LOG_INFO, "Client '%s' does not read, disconnecting.", conn->username);
+        metric_add(thread_metrics->slow_disconnects, 1);
+        return false;
+    }
+    metric_observe(thread_metrics->queue_bytes, conn->queued.load());
+
+    // a message partly written must go out whole, or the stream breaks,
+    // the newest stays as an empty queue takes one message of any size,
+    // and replies are never dropped
+    size_t keep = conn->pending_offset ? 1 : 0;
+    while (out_policy == DROP_OLDEST && conn->queued.load() > out_budget && conn->pending.size() > keep + 1) {
+        if (conn->pending[keep].reply) {
+            keep++;
+            continue;
+        }
+        Message* old = conn->pending[keep].msg;
+        conn->pending.erase(conn->pending.begin() + keep);
+        conn->queued.fetch_sub(old->length);
+        count_drop(conn, old->length);
+        message_unref(old);
+    }
+
+    while (!conn->pending.empty()) {
+        struct iovec iov[WRITE_IOVECS];
+        int count = 0;
+        for (auto it = conn->pending.begin(); it != conn->pending.end() && count < WRITE_IOVECS; ++it, ++count) {
+            size_t skip = count ? 0 : conn->pending_offset;
+            iov[count].iov_base = it->msg->data + skip;
+            iov[count].iov_len = it->msg->length - skip;
+        }
+
+        ssize_t len = writev(conn->socket, iov, count);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return false;
+        }
+
+        metric_add(thread_metrics->bytes_out, len);
+        len += conn->pending_offset;
+        while (!conn->pending.empty() && (size_t)len >= conn->pending.front().msg->length) {
+            Queued done = conn->pending.front();
+            len -= done.msg->length;
+            if (done.reply)
+                conn->replies -= done.msg->length;
+            else
+                conn->queued.fetch_sub(done.msg->length);
+            message_unref(done.msg);
+            conn->pending.pop_front();
+            metric_add(thread_metrics->messages_out, 1);
+        }
+        conn->pending_offset = len;
+    }
+
+    set_events(conn, !conn->pending.empty());
+    return true;
+}
+
+//***************************************************************************
+// client directory
+//
+// The table gives every client a stable slot, the directory maps usernames
+// to slots. Lookups lock one directory shard only and the table is read
+// without a lock, so private messages do not scan the clients and do not
+// contend with joins in other shards.
+
+ClientInfo* client_slot(int id) {
+    ClientInfo* chunk = client_table.chunks[id / TABLE_CHUNK].load();
+    return chunk ? &chunk[id % TABLE_CHUNK] : nullptr;
+}
+
+DirectoryShard& directory_shard(const std::string& name) {
+    return directory[std::hash<std::string>()(name) % DIRECTORY_SHARDS];
+}
+
+void directory_init() {
+    pthread_mutex_init(&client_table.lock, nullptr);
+    client_table.next_id = 0;
+    for (int i = 0; i < TABLE_CHUNKS; i++)
+        client_table.chunks[i] = nullptr;
+    for (DirectoryShard& shard : directory)
+        pthread_mutex_init(&shard.lock, nullptr);
+    pthread_mutex_init(&list_lock, nullptr);
+}
+
+// Gives the connection a slot and makes its name reachable, false when
+// the table is full. A name already taken stays with its first owner.
+bool directory_add(Connection* conn) {
+    pthread_mutex_lock(&client_table.lock);
+    int id;
+    if (!client_table.free_ids.empty()) {
+        id = client_table.free_ids.back();
+        client_table.free_ids.pop_back();
+    } else if (client_table.next_id < TABLE_CHUNK * TABLE_CHUNKS) {
+        id = client_table.next_id++;
+        if (!client_table.chunks[id / TABLE_CHUNK].load())
+            client_table.chunks[id / TABLE_CHUNK] = (ClientInfo*)calloc(TABLE_CHUNK, sizeof(ClientInfo));
+    } else {
+        pthread_mutex_unlock(&client_table.lock);
+        return false;
     }
+    ClientInfo* client = client_slot(id);
+    client->socket = conn->socket;
+    client->username = conn->username;
+    client->conn = conn;
+    client->id = id;
+    client->used = true;
+    conn->id = id;
+    pthread_mutex_unlock(&client_table.lock);
 
+    DirectoryShard& shard = directory_shard(conn->username);
+    pthread_mutex_lock(&shard.lock);
+    shard.ids.emplace(conn->username, id);
+    pthread_mutex_unlock(&shard.lock);
+    list_version.fetch_add(1);
+    return true;
+}
+
+void directory_remove(Connection* conn) {
+    DirectoryShard& shard = directory_shard(conn->username);
+    pthread_mutex_lock(&shard.lock);
+    auto it = shard.ids.find(conn->username);
+    if (it != shard.ids.end() && it->second == conn->id)
+        shard.ids.erase(it);
+    pthread_mutex_unlock(&shard.lock);
+
+    pthread_mutex_lock(&client_table.lock);
+    client_slot(conn->id)->used = false;
+    client_table.free_ids.push_back(conn->id);
+    pthread_mutex_unlock(&client_table.lock);
+    list_version.fetch_add(1);
+}
+
+// Connection with exactly this name, or nullptr. The caller is a reactor
+// inside its read-side section, so the connection is not freed under it.
+Connection* directory_find(const std::string& name) {
+    DirectoryShard& shard = directory_shard(name);
+    Connection* conn = nullptr;
+    pthread_mutex_lock(&shard.lock);
+    auto it = shard.ids.find(name);
+    if (it != shard.ids.end())
+        conn = client_slot(it->second)->conn;
+    pthread_mutex_unlock(&shard.lock);
+    return conn;
+}
+
+// Runs func for every client, under the table lock
+template <typename Func>
+void directory_for_each(Func func) {
+    pthread_mutex_lock(&client_table.lock);
+    for (int id = 0; id < client_table.next_id; id++) {
+        ClientInfo* client = client_slot(id);
+        if (client->used)
+            func(*client);
+    }
+    pthread_mutex_unlock(&client_table.lock);
+}
+
+// References to the cached #list, the caller unrefs them
+Outgoing directory_list() {
+    pthread_mutex_lock(&list_lock);
+    unsigned long version = list_version.load();
+    if (!list_cache || list_cache_version != version) {
+        std::string text;
+        directory_for_each([&text](const ClientInfo& client) {
+            text += "Client: ";
+            text += client.username;
+            text += "\n";
+        });
+        if (list_cache) {
+            message_unref(list_cache);
+            message_unref(list_frame);
+        }
+        list_cache = message_new(text.data(), text.size());
+        list_frame = message_frame(FRAME_LIST, 0, text);
+        list_cache_version = version;
+    }
+    Outgoing out = {list_cache, list_frame};
+    out.text->refs.fetch_add(1);
+    out.frame->refs.fetch_add(1);
+    pthread_mutex_unlock(&list_lock);
+    return out;
+}
+
+//***************************************************************************
+// rooms
+//
+// Rooms are created by the first join and never freed. A client posts into
+// the room it joined last, until it leaves it, and then to everybody again.
+
+// A room name is one word
+std::string room_name(const std::string& text) {
+    return text.substr(0, text.find_first_of(" \t\r\n"));
+}
+
+void room_init(Room* room, const std::string& name) {
+    room->name = name;
+    pthread_mutex_init(&room->lock, nullptr);
+    room->changed = false;
+    room->members = nullptr;
+    room->messages = 0;
+    room->bytes = 0;
+    room->reported = 0;
+    pthread_mutex_init(&room->history_lock, nullptr);
+    room->ring_start = 0;
+}
+
+// Room of the name, created when missing if asked to, nullptr over MAX_ROOMS
+Room* room_get(const std::string& name, bool create) {
+    pthread_mutex_lock(&rooms_lock);
+    Room* room = nullptr;
+    auto it = rooms.find(name);
+    if (it != rooms.end()) {
+        room = it->second;
+    } else if (create && rooms.size() < MAX_ROOMS) {
+        room = new Room();
+        room_init(room, name);
+        rooms[name] = room;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return room;
+}
+
+// Caller holds room->lock. The reactor republishes every room it changed,
+// even when another one got to it first, so a connection that leaves is
+// out of all published arrays before its own grace period starts.
+void room_changed(Room* room) {
+    room->changed = true;
+    current_reactor->rooms_changed.push_back(room);
+}
+
+// False when the connection was in the room already
+bool room_join(Connection* conn, Room* room) {
+    conn->room = room;
+    if (std::find(conn->rooms.begin(), conn->rooms.end(), room) != conn->rooms.end())
+        return false;
+    conn->rooms.push_back(room);
+    pthread_mutex_lock(&room->lock);
+    room->subscribers.push_back(conn);
+    room_changed(room);
+    pthread_mutex_unlock(&room->lock);
+    return true;
+}
+
+// False when the connection was not in the room
+bool room_leave(Connection* conn, Room* room) {
+    auto it = std::find(conn->rooms.begin(), conn->rooms.end(), room);
+    if (it == conn->rooms.end())
+        return false;
+    conn->rooms.erase(it);
+    if (conn->room == room)
+        conn->room = nullptr;
+
+    pthread_mutex_lock(&room->lock);
+    auto sub = std::find(room->subscribers.begin(), room->subscribers.end(), conn);
+    *sub = room->subscribers.back();
+    room->subscribers.pop_back();
+    room_changed(room);
+    pthread_mutex_unlock(&room->lock);
+    return true;
+}
+
+void rooms_publish(Reactor* reactor) {
+    for (Room* room : reactor->rooms_changed) {
+        pthread_mutex_lock(&room->lock);
+        if (room->changed) {
+            Retired item;
+            item.list = room->members.exchange(members_copy(room->subscribers));
+            item.states = rcu_snapshot();
+            reactor->retired.push_back(item);
+            room->changed = false;
+        }
+        pthread_mutex_unlock(&room->lock);
+    }
+    reactor->rooms_changed.clear();
+}
+
+void room_post(Room* room, uint32_t sender, const std::string& text) {
+    long started = now_us();
+    Outgoing out = outgoing_new(FRAME_MESSAGE, sender, text);
+    history_add(room, out);
+    Members* list = room->members.load();
+    for (size_t i = 0; list && i < list->count; i++) {
+        send_out(list->conns[i], out);
+    }
+    outgoing_unref(out);
+    room->messages.fetch_add(1);
+    room->bytes.fetch_add(text.size());
+
+    Metrics* m = my_metrics();
+    metric_add(m->fanouts, 1);
+    metric_add(m->recipients, list ? list->count : 0);
+    metric_observe(m->fanout_us, now_us() - started);
+}
+
+// Prints the rooms with their message rates since the previous call
+void rooms_report() {
+    long now = now_ms();
+    double seconds = (now - rooms_reported_at) / 1000.0;
+    pthread_mutex_lock(&rooms_lock);
+    for (auto& item : rooms) {
+        Room* room = item.second;
+        pthread_mutex_lock(&room->lock);
+        size_t count = room->subscribers.size();
+        pthread_mutex_unlock(&room->lock);
+        long messages = room->messages.load();
+        printf("Room: %s  clients: %zu  messages: %ld  bytes: %ld  rate: %.1f/s\n",
+               room->name.c_str(), count, messages, room->bytes.load(),
+               seconds > 0 ? (messages - room->reported) / seconds : 0.0);
+        room->reported = messages;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    rooms_reported_at = now;
+}
+
+//***************************************************************************
+// history
+//
+// Every room, and the lobby for messages to everybody, keeps its last
+// messages in a ring. A joiner gets them queued at once and the reactor
+// writes them out together with one writev. With -l the messages also go
+// to append-only segment files. The log thread writes whatever queued up
+// meanwhile in one batch and syncs it once, and only the newest log_keep
+// segments stay. #history is answered by the log thread too, it reads at
+// most HISTORY_SEGMENTS segments through mmap from the newest backwards
+// and hands the texts to the reactor of the client.
+
+void history_add(Room* room, const Outgoing& out) {
+    if (ring_size) {
+        out.text->refs.fetch_add(1);
+        out.frame->refs.fetch_add(1);
+        pthread_mutex_lock(&room->history_lock);
+        if (room->ring.size() < ring_size) {
+            room->ring.push_back(out);
+        } else {
+            outgoing_unref(room->ring[room->ring_start]);
+            room->ring[room->ring_start] = out;
+            room->ring_start = (room->ring_start + 1) % ring_size;
+        }
+        pthread_mutex_unlock(&room->history_lock);
+    }
+
+    if (!log_dir)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    LogEntry entry = {room, out.text, ts.tv_sec * 1000L + ts.tv_nsec / 1000000};
+    pthread_mutex_lock(&log_lock);
+    if (log_queue.size() < LOG_QUEUE_MAX) {
+        out.text->refs.fetch_add(1);
+        log_queue.push_back(entry);
+        if (log_queue.size() == 1)
+            pthread_cond_signal(&log_cond);
+    } else {
+        log_dropped.fetch_add(1);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Queues the ring of the room for the connection, oldest first
+void history_replay(Connection* conn, Room* room) {
+    std::vector<Outgoing> copy;
+    pthread_mutex_lock(&room->history_lock);
+    for (size_t i = 0; i < room->ring.size(); i++) {
+        const Outgoing& out = room->ring[(room->ring_start + i) % room->ring.size()];
+        out.text->refs.fetch_add(1);
+        out.frame->refs.fetch_add(1);
+        copy.push_back(out);
+    }
+    pthread_mutex_unlock(&room->history_lock);
+    for (const Outgoing& out : copy) {
+        reply_out(conn, out);
+        outgoing_unref(out);
+    }
+}
+
+// Replays after the joiners are published, so a message posted meanwhile
+// may come twice but none is missed
+void history_replay_joiners(Reactor* reactor) {
+    for (auto& item : reactor->replays) {
+        if (!item.first->closed)
+            history_replay(item.first, item.second);
+    }
+    reactor->replays.clear();
+}
+
+std::string log_path(int segment) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/chat-%08d.log", log_dir, segment);
+    return path;
+}
+
+bool log_open_segment(int segment) {
+    int fd = open(log_path(segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_msg(LOG_ERROR, "Unable to open log segment %d: %s", segment, strerror(errno));
+        return false;
+    }
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+    log_size = 0;
+    log_segment.store(segment);
+
+    // retention, the log thread is the only reader of old segments
+    while (segment - log_first >= log_keep) {
+        unlink(log_path(log_first).c_str());
+        log_first++;
+    }
+    return true;
+}
+
+// Writes all of iov, IOV_MAX pieces at a time
+int writev_all(int fd, std::vector<struct iovec>& iov) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = std::min(iov.size() - first, (size_t)IOV_MAX);
+        ssize_t len = writev(fd, &iov[first], count);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (first < iov.size() && (size_t)len >= iov[first].iov_len) {
+            len -= iov[first].iov_len;
+            first++;
+        }
+        if (len > 0) {
+            iov[first].iov_base = (char*)iov[first].iov_base + len;
+            iov[first].iov_len -= len;
+        }
+    }
+    return 0;
+}
+
+// Writes one batch of records, a segment never splits a record
+void log_write(std::vector<LogEntry>& batch) {
+    std::vector<LogRecord> heads(batch.size());
+    std::vector<struct iovec> iov;
+    for (size_t i = 0; i < batch.size(); i++) {
+        LogEntry& entry = batch[i];
+        heads[i].length = entry.text->length;
+        heads[i].room_length = entry.room->name.size();
+        heads[i].reserved = 0;
+        heads[i].time = entry.time;
+        size_t bytes = sizeof(LogRecord) + entry.room->name.size() + entry.text->length;
+        if (log_size + bytes > LOG_SEGMENT && log_size > 0) {
+            if (!iov.empty() && writev_all(log_fd, iov) < 0)
+                log_msg(LOG_ERROR, "Unable to write the log: %s", strerror(errno));
+            iov.clear();
+            fdatasync(log_fd);
+            log_open_segment(log_segment.load() + 1);
+        }
+        iov.push_back({&heads[i], sizeof(LogRecord)});
+        iov.push_back({(void*)entry.room->name.data(), entry.room->name.size()});
+        iov.push_back({entry.text->data, entry.text->length});
+        log_size += bytes;
+    }
+    if (!iov.empty() && writev_all(log_fd, iov) < 0)
+        log_msg(LOG_ERROR, "Unable to write the log: %s", strerror(errno));
+    fdatasync(log_fd);
+}
+
+std::vector<std::string> log_read(const std::string& room, size_t count);
+
+// Answers after the batch is written, so a #history sees its own messages
+void log_answer(std::vector<HistoryRequest>& requests) {
+    for (HistoryRequest& request : requests) {
+        Reactor* reactor = request.conn->reactor;
+        HistoryAnswer answer = {request.conn, log_read(request.room, request.count)};
+        pthread_mutex_lock(&reactor->answers_lock);
+        reactor->answers.push_back(std::move(answer));
+        pthread_mutex_unlock(&reactor->answers_lock);
+        reactor_wake(reactor);
+    }
+    requests.clear();
+}
+
+void* log_loop(void*) {
+    std::vector<LogEntry> batch;
+    std::vector<HistoryRequest> requests;
+    pthread_mutex_lock(&log_lock);
     while (1) {
-        int len = read(client_socket, buffer, BUFFER_SIZE - 1);
-        if (len <= 0) {
-            log_msg(LOG_INFO, "Client '%s' disconnected.", client_info->username);
+        while (log_queue.empty() && log_requests.empty() && !log_quit)
+            pthread_cond_wait(&log_cond, &log_lock);
+        if (log_queue.empty() && log_requests.empty())
             break;
+        batch.swap(log_queue);
+        requests.swap(log_requests);
+        pthread_mutex_unlock(&log_lock);
+
+        // group commit, one sync for everything that queued up meanwhile
+        if (!batch.empty())
+            log_write(batch);
+        for (LogEntry& entry : batch)
+            message_unref(entry.text);
+        batch.clear();
+        log_answer(requests);
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return nullptr;
+}
+
+// Continues after the newest segment in the directory
+bool log_start(const char* dir) {
+    mkdir(dir, 0755);
+    DIR* d = opendir(dir);
+    if (!d) {
+        log_msg(LOG_ERROR, "Unable to open log directory '%s'.", dir);
+        return false;
+    }
+    int first = INT_MAX, last = -1;
+    struct dirent* ent;
+    while ((ent = readdir(d))) {
+        int segment;
+        if (sscanf(ent->d_name, "chat-%d.log", &segment) == 1) {
+            first = std::min(first, segment);
+            last = std::max(last, segment);
         }
-        buffer[len] = '\0';
+    }
+    closedir(d);
 
-        // Remove trailing newline or return 
-        if (len > 0 && (buffer[len - 1] == '\n')) {
-            buffer[len - 1] = '\0';
+    log_dir = dir;
+    log_first = last < 0 ? 0 : first;
+    log_msg(LOG_INFO, "Keeping the newest %d log segments.", log_keep);
+    pthread_mutex_init(&log_lock, nullptr);
+    pthread_cond_init(&log_cond, nullptr);
+    if (!log_open_segment(last + 1))
+        return false;
+    if (pthread_create(&log_thread, nullptr, log_loop, nullptr) != 0) {
+        perror("Failed to create thread");
+        return false;
+    }
+    return true;
+}
+
+// Writes out what is queued and stops the log thread
+void log_stop() {
+    if (!log_dir)
+        return;
+    pthread_mutex_lock(&log_lock);
+    log_quit = true;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_thread, nullptr);
+    close(log_fd);
+}
+
+// Last count texts of the room in the newest HISTORY_SEGMENTS segments,
+// oldest first. Runs in the log thread.
+std::vector<std::string> log_read(const std::string& room, size_t count) {
+    std::vector<std::string> found;     // newest first
+    int last = log_segment.load();
+    int first = std::max(log_first, last - HISTORY_SEGMENTS + 1);
+    for (int segment = last; segment >= first && found.size() < count; segment--) {
+        int fd = open(log_path(segment).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
+            continue;
         }
+        char* map = (char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            continue;
 
-        log_msg(LOG_INFO, "Received message from '%s': %s", client_info->username, buffer);
+        // records are found front to back, a record still being written is skipped
+        std::vector<std::pair<size_t, size_t>> hits;
+        size_t offset = 0;
+        while (offset + sizeof(LogRecord) <= (size_t)st.st_size) {
+            LogRecord head;
+            memcpy(&head, map + offset, sizeof(head));
+            size_t end = offset + sizeof(head) + head.room_length + head.length;
+            if (end > (size_t)st.st_size)
+                break;
+            if (head.room_length == room.size() && !memcmp(map + offset + sizeof(head), room.data(), room.size()))
+                hits.push_back({offset + sizeof(head) + head.room_length, head.length});
+            offset = end;
+        }
+        for (size_t i = hits.size(); i-- > 0 && found.size() < count;)
+            found.push_back(std::string(map + hits[i].first, hits[i].second));
+        munmap(map, st.st_size);
+    }
+    std::reverse(found.begin(), found.end());
+    return found;
+}
+
+//***************************************************************************
+// reactors
 
-        if (strncmp(STR_LIST, buffer, strlen(STR_LIST)) == 0) {
-            pthread_mutex_lock(&lock);
-            for (const ClientInfo& client : client_sockets) {
-                char msg[BUFFER_SIZE];
-                snprintf(msg, BUFFER_SIZE, "Client: %s\n", client.username);
-                write(client_socket, msg, strlen(msg));
+void send_notice(Connection* conn, const std::string& text) {
+    Outgoing out = outgoing_new(FRAME_MESSAGE, 0, text);
+    reply_out(conn, out);
+    outgoing_unref(out);
+}
+
+// Handle one message from the client
+void handle_message(Connection* conn, const std::string& message) {
+    uint32_t sender = conn->id + 1;
+    metric_add(thread_metrics->messages_in, 1);
+    metric_add(thread_metrics->bytes_in, message.size());
+    if (message.compare(0, strlen(STR_LIST), STR_LIST) == 0) {
+        Outgoing list = directory_list();
+        if (list.text->length)
+            reply_out(conn, list);
+        outgoing_unref(list);
+    }else if (message.compare(0, strlen(STR_HISTORY), STR_HISTORY) == 0) {
+        Room* room = conn->room ? conn->room : &lobby;
+        if (!log_dir) {
+            send_notice(conn, "History is not logged.\n");
+            return;
+        }
+        long count = atol(message.c_str() + strlen(STR_HISTORY));
+        count = std::min(count > 0 ? count : (long)DEFAULT_RING, (long)HISTORY_MAX);
+        conn->history_pending++;
+        pthread_mutex_lock(&log_lock);
+        log_requests.push_back({conn, room->name, (size_t)count});
+        pthread_cond_signal(&log_cond);
+        pthread_mutex_unlock(&log_lock);
+    }else if (message.compare(0, strlen(STR_JOIN), STR_JOIN) == 0) {
+        std::string name = room_name(message.substr(strlen(STR_JOIN)));
+        Room* room = nullptr;
+        if (name.size() > ROOM_NAME_MAX)
+            send_notice(conn, "Room name is longer than " + std::to_string(ROOM_NAME_MAX) + " bytes.\n");
+        else if (!name.empty())
+            room = room_get(name, true);
+        if (room) {
+            send_notice(conn, "Joined room '" + name + "'.\n");
+            if (room_join(conn, room))
+                conn->reactor->replays.push_back({conn, room});
+        } else if (name.size() <= ROOM_NAME_MAX) {
+            send_notice(conn, "Cannot join room '" + name + "'.\n");
+        }
+    }else if (message.compare(0, strlen(STR_LEAVE), STR_LEAVE) == 0) {
+        std::string name = room_name(message.substr(strlen(STR_LEAVE)));
+        Room* room = room_get(name, false);
+        if (room && room_leave(conn, room))
+            send_notice(conn, "Left room '" + name + "'.\n");
+        else
+            send_notice(conn, "Not in room '" + name + "'.\n");
+    }else if (message.compare(0, 1, "#") == 0) {
+        // "#name text", the name ends at the first space
+        size_t end = std::min(message.find(' '), message.size());
+        Connection* target = directory_find(message.substr(1, end - 1));
+        if (target) {
+            Outgoing out = outgoing_new(FRAME_PRIVATE, sender,
+                                        std::string(conn->username) + ": " + message.substr(end) + "\n");
+            send_out(target, out);
+            outgoing_unref(out);
+        }
+    }else if (conn->room) {
+        room_post(conn->room, sender, "[" + conn->room->name + "] " + conn->username + ": " + message + "\n");
+    }else {
+        broadcast_to_clients(sender, std::string(conn->username) + ": " + message + "\n");
+    }
+}
+
+// Longest frame payload accepted. A message must fit the budget of its
+// recipients with its frame header and the sender prefix, at most
+// BUFFER_SIZE, or every recipient would count as a slow reader.
+size_t frame_limit() {
+    long limit = out_budget - (long)sizeof(FrameHeader) - BUFFER_SIZE;
+    return std::min((long)MAX_FRAME, std::max(limit, (long)BUFFER_SIZE));
+}
+
+// Handles the complete frames in conn->input and keeps the rest. Frames
+// over frame_limit are read past and refused with a notice.
+bool binary_parse(Connection* conn) {
+    size_t offset = 0;
+    while (true) {
+        size_t skipped = std::min(conn->skip, conn->input.size() - offset);
+        offset += skipped;
+        conn->skip -= skipped;
+        if (conn->skip || conn->input.size() - offset < sizeof(FrameHeader))
+            break;
+        FrameHeader header;
+        memcpy(&header, conn->input.data() + offset, sizeof(header));
+        size_t length = ntohl(header.length);
+        if (length > frame_limit()) {
+            log_msg(LOG_INFO, "Client '%s' sent a frame of %zu bytes, refused.", conn->username, length);
+            send_notice(conn, "Message refused, longer than " + std::to_string(frame_limit()) + " bytes.\n");
+            offset += sizeof(header);
+            conn->skip = length;
+            continue;
+        }
+        if (conn->input.size() - offset < sizeof(header) + length)
+            break;
+        if (header.type == FRAME_MESSAGE)
+            handle_message(conn, conn->input.substr(offset + sizeof(header), length));
+        offset += sizeof(header) + length;
+    }
+    conn->input.erase(0, offset);
+    return true;
+}
+
+// Reads frames of a binary client, false when it has to be disconnected
+bool binary_read(Connection* conn) {
+    char buffer[READ_CHUNK];
+    int len = read(conn->socket, buffer, sizeof(buffer));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (len <= 0)
+        return false;
+    conn->input.append(buffer, len);
+    return binary_parse(conn);
+}
+
+void free_connection(Connection* conn) {
+    OutNode* node = conn->inbox.exchange(nullptr);
+    while (node) {
+        OutNode* next = node->next;
+        message_unref(node->msg);
+        delete node;
+        node = next;
+    }
+    free(conn->username);
+    delete conn;
+}
+
+void disconnect_client(Connection* conn) {
+    log_msg(LOG_INFO, "Client '%s' disconnected.", conn->username);
+    if (conn->dropped.load())
+        log_msg(LOG_INFO, "Client '%s' missed %ld bytes of messages.", conn->username, conn->dropped.load());
+    conn->closed = true;
+
+    directory_remove(conn);
+    metric_add(thread_metrics->clients, -1);
+    while (!conn->rooms.empty())
+        room_leave(conn, conn->rooms.back());
+    members_leave(conn->reactor, conn);
+
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->socket, nullptr);
+    close(conn->socket);
+    conn->reactor->clients--;
+    for (Queued& item : conn->pending)
+        message_unref(item.msg);
+    conn->pending.clear();
+    // other reactors may still be sending to it, it is freed after a grace period
+}
+
+// A new connection is served by its reactor from the start. Until the
+// username arrives it is on the handshake list only, no other thread can
+// see it, so it is freed at once when it fails or times out.
+
+void handshake_forget(Reactor* reactor, Connection* conn) {
+    Connection* last = reactor->handshakes.back();
+    reactor->handshakes[conn->handshake_index] = last;
+    last->handshake_index = conn->handshake_index;
+    reactor->handshakes.pop_back();
+    metric_add(thread_metrics->handshakes, -1);
+    free(conn->hello);
+    conn->hello = nullptr;
+}
+
+void handshake_drop(Reactor* reactor, Connection* conn) {
+    handshake_forget(reactor, conn);
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->socket, nullptr);
+    close(conn->socket);
+    reactor->clients--;
+    free_connection(conn);
+}
+
+// Reads the username line, false when the connection has to be dropped
+bool handshake_read(Reactor* reactor, Connection* conn) {
+    int len = read(conn->socket, conn->hello + conn->hello_len, BUFFER_SIZE - 1 - conn->hello_len);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (len <= 0) {
+        log_msg(LOG_INFO, "Client disconnected.");
+        return false;
+    }
+    conn->hello_len += len;
+    conn->hello[conn->hello_len] = '\0';
+
+    // a name longer than the buffer is cut
+    char* end = (char*)memchr(conn->hello, '\n', conn->hello_len);
+    if (!end && conn->hello_len < BUFFER_SIZE - 1)
+        return true;
+    char* rest = conn->hello + conn->hello_len;
+    if (end) {
+        *end = '\0';
+        rest = end + 1;
+        if (end > conn->hello && end[-1] == '\r')
+            end[-1] = '\0';
+    }
+
+    const char* name = conn->hello;
+    if (strncmp(name, STR_BINARY, strlen(STR_BINARY)) == 0) {
+        conn->binary = true;
+        name += strlen(STR_BINARY);
+    }
+    conn->username = strdup(name);
+    if (!directory_add(conn)) {
+        log_msg(LOG_ERROR, "Client table is full, '%s' refused.", conn->username);
+        return false;
+    }
+    log_msg(LOG_INFO, "Client '%s' connected.\nOn port %d", conn->username, conn->port);
+    metric_add(thread_metrics->clients, 1);
+    members_join(reactor, conn);
+    reactor->replays.push_back({conn, &lobby});
+
+    // the first messages may come in the same segment as the name
+    if (conn->binary) {
+        conn->input.assign(rest, conn->hello + conn->hello_len - rest);
+        handshake_forget(reactor, conn);
+        if (!binary_parse(conn))
+            disconnect_client(conn);
+        return true;
+    }
+    size_t rest_len = strlen(rest);
+    if (rest_len) {
+        if (rest[rest_len - 1] == '\n')
+            rest[rest_len - 1] = '\0';
+        log_msg(LOG_INFO, "Received message from '%s': %s", conn->username, rest);
+        handle_message(conn, rest);
+    }
+    handshake_forget(reactor, conn);
+    return true;
+}
+
+// Drops connections that did not send a username in time
+void handshake_expire(Reactor* reactor) {
+    long now = now_ms();
+    if (reactor->handshakes.empty() || now < reactor->handshake_due)
+        return;
+    reactor->handshake_due = LONG_MAX;
+    for (size_t i = 0; i < reactor->handshakes.size();) {
+        Connection* conn = reactor->handshakes[i];
+        if (conn->deadline <= now) {
+            log_msg(LOG_INFO, "Client on port %d sent no username, disconnected.", conn->port);
+            handshake_drop(reactor, conn);
+        } else {
+            reactor->handshake_due = std::min(reactor->handshake_due, conn->deadline);
+            i++;
+        }
+    }
+}
+
+// Moves connections handed over by the accepting thread into the epoll set
+void reactor_take_new(Reactor* reactor) {
+    uint64_t count;
+    read(reactor->wake_fd, &count, sizeof(count));
+
+    std::vector<Connection*> incoming;
+    pthread_mutex_lock(&reactor->queue_lock);
+    incoming.swap(reactor->queue);
+    pthread_mutex_unlock(&reactor->queue_lock);
+
+    long now = now_ms();
+    for (Connection* conn : incoming) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev);
+        reactor->clients++;
+
+        conn->hello = (char*)malloc(BUFFER_SIZE);
+        conn->hello_len = 0;
+        conn->deadline = now + handshake_ms;
+        conn->handshake_index = reactor->handshakes.size();
+        reactor->handshakes.push_back(conn);
+        metric_add(thread_metrics->handshakes, 1);
+        reactor->handshake_due = std::min(reactor->handshake_due, conn->deadline);
+    }
+}
+
+// Writes out what other threads queued for the connections of this reactor
+void reactor_flush_ready(Reactor* reactor) {
+    Connection* conn = reactor->ready.exchange(nullptr);
+    while (conn) {
+        Connection* next = conn->ready_next;
+        conn->scheduled.store(false);
+        if (!conn->closed && !flush_client(conn))
+            disconnect_client(conn);
+        conn = next;
+    }
+}
+
+// Sends the texts the log thread found, and frees closed connections
+// that were only kept for their answer
+void history_deliver(Reactor* reactor) {
+    std::vector<HistoryAnswer> answers;
+    pthread_mutex_lock(&reactor->answers_lock);
+    answers.swap(reactor->answers);
+    pthread_mutex_unlock(&reactor->answers_lock);
+
+    for (HistoryAnswer& answer : answers) {
+        Connection* conn = answer.conn;
+        conn->history_pending--;
+        if (!conn->closed) {
+            for (const std::string& text : answer.texts) {
+                Outgoing out = outgoing_new(FRAME_MESSAGE, 0, text);
+                reply_out(conn, out);
+                outgoing_unref(out);
             }
-            pthread_mutex_unlock(&lock);
-        }else if (strncmp("#", buffer, 1) == 0) {
-            pthread_mutex_lock(&lock); 
-            for (ClientInfo& client : client_sockets) {
-                if (strncmp(buffer + 1, client.username, strlen(client.username)) == 0) {
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, BUFFER_SIZE, "%s: %s\n", client_info->username, buffer + strlen(client.username) + 1);
-                    write(client.socket, msg, strlen(msg));
-                    break;
+            continue;
+        }
+        auto it = std::find(reactor->lingering.begin(), reactor->lingering.end(), conn);
+        if (!conn->history_pending && it != reactor->lingering.end()) {
+            reactor->lingering.erase(it);
+            free_connection(conn);
+        }
+    }
+}
+
+// Frees member arrays and connections that no other reactor can reach
+void reactor_reclaim(Reactor* reactor) {
+    if (reactor->retired.empty())
+        return;
+    std::vector<Retired> done;
+    size_t kept = 0;
+    for (size_t i = 0; i < reactor->retired.size(); i++) {
+        if (rcu_passed(reactor->retired[i].states))
+            done.push_back(reactor->retired[i]);
+        else
+            std::swap(reactor->retired[kept++], reactor->retired[i]);
+    }
+    reactor->retired.resize(kept);
+
+    // senders finished before the grace period ended, so the ready list
+    // already holds every pointer they left behind
+    reactor_flush_ready(reactor);
+    for (Retired& item : done) {
+        free(item.list);
+        for (Connection* conn : item.conns) {
+            if (conn->history_pending)
+                reactor->lingering.push_back(conn);
+            else
+                free_connection(conn);
+        }
+    }
+}
+
+// Event loop of one reactor thread, serves all clients of its shard
+void* reactor_loop(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    current_reactor = reactor;
+    metrics_register();
+    struct epoll_event events[EPOLL_EVENTS];
+
+    while (1) {
+        // retired connections need this reactor awake to be freed
+        int timeout = reactor->retired.empty() && !reactor->shard_changed ? -1 : 10;
+        if (!reactor->handshakes.empty()) {
+            long wait = std::max(0L, reactor->handshake_due - now_ms());
+            if (timeout < 0 || wait < timeout)
+                timeout = (int)std::min(wait, (long)INT_MAX);
+        }
+        int count = epoll_wait(reactor->epoll_fd, events, EPOLL_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERROR, "Function epoll_wait failed!");
+            break;
+        }
+
+        rcu_online(reactor);
+        for (int i = 0; i < count; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (!conn) {
+                reactor_take_new(reactor);
+                history_deliver(reactor);
+                continue;
+            }
+            if (conn->closed)
+                continue;
+            if (conn->hello) {
+                if (!handshake_read(reactor, conn))
+                    handshake_drop(reactor, conn);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                if (!flush_client(conn)) {
+                    disconnect_client(conn);
+                    continue;
                 }
             }
-            pthread_mutex_unlock(&lock);
-        }else {
-            char msg[BUFFER_SIZE];
-            snprintf(msg, BUFFER_SIZE, "%s: %s\n", client_info->username, buffer);
-            broadcast_to_clients(msg);
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                continue;
+            if (conn->binary) {
+                if (!binary_read(conn))
+                    disconnect_client(conn);
+                continue;
+            }
+
+            char buffer[BUFFER_SIZE];
+            int len = read(conn->socket, buffer, BUFFER_SIZE - 1);
+            if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (len <= 0) {
+                disconnect_client(conn);
+                continue;
+            }
+            buffer[len] = '\0';
+
+            // Remove trailing newline or return 
+            if (len > 0 && (buffer[len - 1] == '\n')) {
+                buffer[len - 1] = '\0';
+            }
+
+            log_msg(LOG_INFO, "Received message from '%s': %s", conn->username, buffer);
+            handle_message(conn, buffer);
         }
-    }
+        reactor_flush_ready(reactor);
+        handshake_expire(reactor);
+        rooms_publish(reactor);
+        members_publish(reactor);
+        history_replay_joiners(reactor);
+        rcu_offline(reactor);
 
-    pthread_mutex_lock(&lock);
-    auto it = std::find_if(client_sockets.begin(), client_sockets.end(),
-                        [client_socket](const ClientInfo& client) { return client.socket == client_socket; });
-    if (it != client_sockets.end()) {
-        free(it->username);
-        client_sockets.erase(it);
+        reactor_reclaim(reactor);
     }
-    pthread_mutex_unlock(&lock);
-    close(client_socket);
     return nullptr;
 }
 
+void start_reactors(int count) {
+    for (int i = 0; i < count; i++) {
+        Reactor* reactor = new Reactor();
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&reactor->queue_lock, nullptr);
+        pthread_mutex_init(&reactor->answers_lock, nullptr);
+        reactor->clients = 0;
+        reactor->ready = nullptr;
+        reactor->rcu_state = 0;
+        reactor->shard_changed = false;
+        reactor->members = nullptr;
+        reactor->handshake_due = LONG_MAX;
+        if (reactor->epoll_fd < 0 || reactor->wake_fd < 0) {
+            perror("Failed to create reactor");
+            exit(1);
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;          // the wake-up eventfd
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev);
+        reactors.push_back(reactor);
+    }
+
+    // all reactors exist before any of them takes an RCU snapshot
+    for (Reactor* reactor : reactors) {
+        if (pthread_create(&reactor->thread, NULL, reactor_loop, reactor) != 0) {
+            perror("Failed to create thread");
+            exit(1);
+        }
+        pthread_detach(reactor->thread);
+    }
+}
+
+// Hands the connection to the next reactor round-robin
+void dispatch_client(Connection* conn) {
+    Reactor* reactor = reactors[next_reactor++ % reactors.size()];
+    conn->reactor = reactor;
+
+    pthread_mutex_lock(&reactor->queue_lock);
+    reactor->queue.push_back(conn);
+    pthread_mutex_unlock(&reactor->queue_lock);
+    reactor_wake(reactor);
+}
+
+std::string metrics_text() {
+    Metrics m;
+    metrics_sum(m);
+    std::string out;
+    metrics_line(out, "chat_clients", "gauge", "Connected clients with a username.", m.clients);
+    metrics_line(out, "chat_handshakes", "gauge", "Connections waiting for a username.", m.handshakes);
+    metrics_line(out, "chat_messages_in_total", "counter", "Messages received from clients.", m.messages_in);
+    metrics_line(out, "chat_bytes_in_total", "counter", "Bytes of messages received from clients.", m.bytes_in);
+    metrics_line(out, "chat_messages_out_total", "counter", "Messages written to clients.", m.messages_out);
+    metrics_line(out, "chat_bytes_out_total", "counter", "Bytes written to clients.", m.bytes_out);
+    metrics_line(out, "chat_fanouts_total", "counter", "Broadcasts and room posts.", m.fanouts);
+    metrics_line(out, "chat_fanout_recipients_total", "counter", "Recipients of broadcasts and room posts.", m.recipients);
+    metrics_line(out, "chat_dropped_messages_total", "counter", "Messages dropped for slow clients.", m.dropped_messages);
+    metrics_line(out, "chat_dropped_bytes_total", "counter", "Bytes dropped for slow clients.", m.dropped_bytes);
+    metrics_line(out, "chat_slow_disconnects_total", "counter", "Clients disconnected for not reading.", m.slow_disconnects);
+    metrics_line(out, "chat_log_suppressed", "gauge", "Log lines suppressed since the last flush.", logger_suppressed.load());
+    metrics_line(out, "chat_history_not_logged_total", "counter", "Messages missing in the history log.", log_dropped.load());
+    metrics_histogram(out, "chat_fanout_seconds", "Time to queue a message for all its recipients.", m.fanout_us, 1e-6);
+    metrics_histogram(out, "chat_queue_depth_bytes", "Bytes queued for a client when its reactor writes.", m.queue_bytes, 1);
+    return out;
+}
+
+// Local scrape endpoint, connections are answered from the main loop
+void metrics_listen(const char* path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    metrics_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_socket < 0 || bind(metrics_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(metrics_socket, 16) < 0) {
+        perror("Failed to create the metrics socket");
+        exit(1);
+    }
+}
+
+// Answers one scrape. An HTTP request gets an HTTP response, anything else,
+// or nothing within METRICS_WAIT_MS, gets the bare text.
+void metrics_reply(int fd) {
+    char request[512];
+    int len = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+    std::string body = metrics_text();
+    std::string reply;
+    if (len > 4 && !strncmp(request, "GET ", 4)) {
+        char head[256];
+        snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n\r\n", body.size());
+        reply = head;
+    }
+    reply += body;
+    size_t done = 0;
+    while (done < reply.size()) {
+        ssize_t sent = send(fd, reply.data() + done, reply.size() - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (errno != EAGAIN || poll(&pfd, 1, METRICS_WAIT_MS) <= 0)
+                break;
+            continue;
+        }
+        done += sent;
+    }
+    close(fd);
+}
+
+// Tens of thousands of clients need more descriptors than the usual soft limit
+void raise_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("Usage: %s port_number\n", argv[0]);
+    int num_reactors = DEFAULT_REACTORS;
+    int port = 0;
+    const char* history_dir = nullptr;
+    const char* metrics_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            num_reactors = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            handshake_ms = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            out_budget = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            ring_size = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            history_dir = argv[++i];
+        } else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+            log_keep = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+            const char* policy = argv[++i];
+            if (!strcmp(policy, "newest"))
+                out_policy = DROP_NEWEST;
+            else if (!strcmp(policy, "disconnect"))
+                out_policy = DISCONNECT_SLOW;
+            else
+                out_policy = DROP_OLDEST;
+        } else if (*argv[i] != '-') {
+            port = atoi(argv[i]);
+        }
+    }
+    if (port <= 0 || num_reactors <= 0 || out_budget <= 0 || handshake_ms <= 0 || log_keep <= 0) {
+        printf("Usage: %s [-t threads -w ms -b bytes -q policy -r count -l dir -k segments -m socket] port_number\n", argv[0]);
+        printf("    -t  epoll threads serving the clients (default %d)\n", DEFAULT_REACTORS);
+        printf("    -w  time to send the username (default %d ms)\n", DEFAULT_HANDSHAKE_MS);
+        printf("    -b  bytes queued for a client that does not read (default %d)\n", DEFAULT_OUT_BUDGET);
+        printf("    -q  over budget: oldest, newest (drop them) or disconnect\n");
+        printf("    -r  messages per room replayed to joiners (default %d)\n", DEFAULT_RING);
+        printf("    -l  directory of the message log, #history reads it\n");
+        printf("    -k  newest log segments kept (default %d)\n", DEFAULT_LOG_KEEP);
+        printf("    -m  Unix socket serving #metrics in Prometheus format\n");
         exit(1);
     }
-    int port = atoi(argv[1]);
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    // non-blocking, a burst of clients is accepted until EAGAIN
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         perror("Failed to create socket");
         exit(1);
@@ -170,7 +1999,7 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (listen(server_socket, 5) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(server_socket);
         exit(1);
@@ -183,59 +2012,104 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // a client that closed its socket must not kill the server in writev
+    signal(SIGPIPE, SIG_IGN);
+    logger_start();
+    metrics_register();
     log_msg(LOG_INFO, "Server will listen on port: %d", port);
-    pthread_mutex_init(&lock, nullptr);
+    directory_init();
+    pthread_mutex_init(&rooms_lock, nullptr);
+    rooms_reported_at = now_ms();
+    room_init(&lobby, "");
+    if (history_dir) {
+        if (!log_start(history_dir))
+            exit(1);
+        log_msg(LOG_INFO, "Messages are logged to '%s'.", history_dir);
+    }
+    raise_file_limit();
+    start_reactors(num_reactors);
+    log_msg(LOG_INFO, "Clients are served by %d epoll threads.", num_reactors);
+    if (metrics_path) {
+        metrics_listen(metrics_path);
+        log_msg(LOG_INFO, "Metrics are served on '%s'.", metrics_path);
+    }
 
-    struct pollfd fds[2];
-    fds[0].fd = server_socket;
-    fds[0].events = POLLIN;
-    fds[1].fd = STDIN_FILENO;
-    fds[1].events = POLLIN;
+    // scrapes that connected, with the time they have to send a request
+    std::vector<std::pair<int, long>> scrapes;
+    std::vector<struct pollfd> fds;
 
     while (1) {
-        int poll_res = poll(fds, 2, -1);
+        fds.assign(3, pollfd());
+        fds[0].fd = server_socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = STDIN_FILENO;
+        fds[1].events = POLLIN;
+        fds[2].fd = metrics_socket;     // ignored by poll while -1
+        fds[2].events = POLLIN;
+        int timeout = -1;
+        for (auto& scrape : scrapes) {
+            fds.push_back({scrape.first, POLLIN, 0});
+            int left = std::max(0L, scrape.second - now_ms());
+            timeout = timeout < 0 ? left : std::min(timeout, left);
+        }
+
+        int poll_res = poll(fds.data(), fds.size(), timeout);
         if (poll_res < 0) {
+            if (errno == EINTR)
+                continue;
             perror("Poll error");
             break;
         }
 
-        if (fds[0].revents & POLLIN) {
+        long now = now_ms();
+        size_t kept = 0;
+        for (size_t i = 0; i < scrapes.size(); i++) {
+            if (fds[3 + i].revents || scrapes[i].second <= now)
+                metrics_reply(scrapes[i].first);
+            else
+                scrapes[kept++] = scrapes[i];
+        }
+        scrapes.resize(kept);
+        while (fds[2].revents & POLLIN) {
+            int fd = accept4(metrics_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                break;
+            scrapes.push_back({fd, now + METRICS_WAIT_MS});
+        }
+
+        while (fds[0].revents & POLLIN) {
             struct sockaddr_in client_addr;
             socklen_t client_len = sizeof(client_addr);
-            int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+            int client_socket = accept4(server_socket, (struct sockaddr*)&client_addr, &client_len,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
             if (client_socket < 0) {
-                perror("Failed to accept client");
-                continue;
+                if (errno != EAGAIN && errno != EINTR)
+                    perror("Failed to accept client");
+                break;
             }
 
-            write(client_socket, "Enter a username: ", sizeof("Enter a username: "));
-            char buffer[BUFFER_SIZE];
-            int len = read(client_socket, buffer, BUFFER_SIZE - 1);
-            if (len <= 0) {
-                log_msg(LOG_INFO, "Client disconnected.");
-                close(client_socket);
-                continue;
-            }
-            buffer[len - 1] = '\0';
+            // the reactor reads the username, the prompt fits an empty socket buffer
+            write(client_socket, STR_PROMPT, sizeof(STR_PROMPT));
 
-            ClientInfo client = {client_socket, strdup(buffer)};
-            pthread_mutex_lock(&lock);
-            client_sockets.push_back(client);
-            pthread_mutex_unlock(&lock);
-
-            log_msg(LOG_INFO, "Client '%s' connected.\nOn port %d", buffer, ntohs(client_addr.sin_port));
-
-            int *client_sock_ptr = (int*)malloc(sizeof(int));
-            *client_sock_ptr = client_socket;
-
-            pthread_t thread;
-            if (pthread_create(&thread, NULL, handle_client, client_sock_ptr) != 0) {
-                perror("Failed to create thread");
-                free(client_sock_ptr);
-                close(client_socket);
-            } else {
-                pthread_detach(thread);
-            }
+            Connection* conn = new Connection();
+            conn->socket = client_socket;
+            conn->username = nullptr;
+            conn->port = ntohs(client_addr.sin_port);
+            conn->binary = false;
+            conn->skip = 0;
+            conn->room = nullptr;
+            conn->history_pending = 0;
+            conn->inbox = nullptr;
+            conn->scheduled = false;
+            conn->pending_offset = 0;
+            conn->queued = 0;
+            conn->dropped = 0;
+            conn->overflow = false;
+            conn->want_out = false;
+            conn->want_in = true;
+            conn->replies = 0;
+            conn->closed = false;
+            dispatch_client(conn);
         }
 
         if (fds[1].revents & POLLIN) {
@@ -246,26 +2120,37 @@ int main(int argc, char *argv[]) {
                 if (strncmp(buffer, STR_QUIT, strlen(STR_QUIT)) == 0) {
                     printf("Quit command received. Shutting down server...\n");
                     break;
+                }else if (strncmp(buffer, STR_METRICS, strlen(STR_METRICS)) == 0) {
+                    fputs(metrics_text().c_str(), stdout);
+                }else if (strncmp(buffer, STR_STATS, strlen(STR_STATS)) == 0) {
+                    Metrics m;
+                    metrics_sum(m);
+                    printf("Dropped: %ld messages, %ld bytes. Slow clients disconnected: %ld\n",
+                           m.dropped_messages.load(), m.dropped_bytes.load(), m.slow_disconnects.load());
+                    if (log_dropped.load())
+                        printf("Messages not logged: %ld\n", log_dropped.load());
+                }else if (strncmp(buffer, STR_ROOMS, strlen(STR_ROOMS)) == 0) {
+                    rooms_report();
                 }else if (strncmp(buffer, STR_LIST, strlen(STR_LIST)) == 0) {
-                    pthread_mutex_lock(&lock);
-                    for (const ClientInfo& client : client_sockets) {
-                        printf("Client: %s\n", client.username);
-                    }
-                    pthread_mutex_unlock(&lock);
+                    Outgoing list = directory_list();
+                    fwrite(list.text->data, 1, list.text->length, stdout);
+                    outgoing_unref(list);
                 }
             }
         }
     }
 
-    pthread_mutex_lock(&lock);
-    for (ClientInfo& client : client_sockets) {
-        free(client.username);
-        close(client.socket);
-    }
-    client_sockets.clear();
-    pthread_mutex_unlock(&lock);
+    // the reactors own the connections, they only see the sockets shut down
+    directory_for_each([](const ClientInfo& client) {
+        shutdown(client.socket, SHUT_RDWR);
+    });
 
     close(server_socket);
-    pthread_mutex_destroy(&lock);
+    if (metrics_socket >= 0) {
+        close(metrics_socket);
+        unlink(metrics_path);
+    }
+    log_stop();
+    logger_stop();
     return 0;
 }
\ No newline at end of file
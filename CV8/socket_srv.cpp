@@ -16,19 +16,43 @@
 #include <pthread.h>
 #include <semaphore.h>
 
-#define MAX_IMAGES 5
+#define LISTEN_BACKLOG 5
 #define BUFFER_SIZE 1024
 #define CHUNK_SIZE 256
+#define CACHE_SHARDS 16
+#define SHARD_BUCKETS 64
+#define DEFAULT_CACHE_BYTES (64L * 1024 * 1024)
 
-typedef struct {
+#define IMAGE_LOADING 0
+#define IMAGE_READY 1
+#define IMAGE_FAILED 2
+
+typedef struct Image {
     char *image_data;      
     sem_t semafor;         
     int size;      
     char image_name[BUFFER_SIZE];        
+    unsigned hash;
+    int state;                  // IMAGE_LOADING until the disk read is over
+    int refs;                   // the cache and every client using the image
+    struct Image *hash_next;    // chain of the shard bucket
+    struct Image *lru_prev;     // LRU list of the shard, newest first
+    struct Image *lru_next;
 } Image;
 
-Image g_images[MAX_IMAGES]; // Array of images
-pthread_mutex_t g_images_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Images hashed by name into shards, each with its own lock, LRU list and
+// part of the byte budget. Lookups lock one shard only briefly, disk reads
+// run unlocked.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // an image of the shard finished loading
+    Image *buckets[SHARD_BUCKETS];
+    Image lru;                  // list head, lru.lru_next is the newest
+    long bytes;
+} CacheShard;
+
+CacheShard g_cache[CACHE_SHARDS];
+long g_shard_budget = DEFAULT_CACHE_BYTES / CACHE_SHARDS;
 
 
 //***************************************************************************
@@ -90,7 +114,13 @@ int load_image(const char *filename, Image *img) {
         return -1;
     }
 
-    fread(img->image_data, 1, img->size, file);
+    if (fread(img->image_data, 1, img->size, file) != (size_t)img->size) {
+        fclose(file);
+        free(img->image_data);
+        img->image_data = NULL;
+        perror("Failed to read image file");
+        return -1;
+    }
     fclose(file);
 
     // Store the filename in image_name
@@ -101,53 +131,176 @@ int load_image(const char *filename, Image *img) {
 }
 
 
-// Find or load image by season name
-Image* get_or_load_image(const char *season) {
-    pthread_mutex_lock(&g_images_mutex);
+unsigned image_hash(const char *name) {
+    unsigned hash = 2166136261u;            // FNV-1a
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
 
-    // Find the image
-    for (int i = 0; i < MAX_IMAGES; i++) {
-        if (g_images[i].image_data && strcmp(season, g_images[i].image_name) == 0) {
-            pthread_mutex_unlock(&g_images_mutex);
-            return &g_images[i];
-        }
+CacheShard* image_shard(unsigned hash) {
+    return &g_cache[hash % CACHE_SHARDS];
+}
+
+Image** image_bucket(CacheShard *shard, unsigned hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % SHARD_BUCKETS];
+}
+
+void cache_init(long bytes) {
+    g_shard_budget = bytes / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &g_cache[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->loaded, NULL);
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        shard->bytes = 0;
     }
+}
 
+void lru_unlink(Image *img) {
+    img->lru_prev->lru_next = img->lru_next;
+    img->lru_next->lru_prev = img->lru_prev;
+}
 
-    // Load the image if not found
-    for (int i = 0; i < MAX_IMAGES; i++) {
-        if (!g_images[i].image_data) {
-            char filename[BUFFER_SIZE];
-            snprintf(filename, sizeof(filename), "%s.jpg", season); 
-            if (load_image(filename, &g_images[i]) == 0) {
+void lru_push(CacheShard *shard, Image *img) {
+    img->lru_prev = &shard->lru;
+    img->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = img;
+    shard->lru.lru_next = img;
+}
 
-                strncpy(g_images[i].image_name, season, BUFFER_SIZE - 1);
-                g_images[i].image_name[BUFFER_SIZE - 1] = '\0';
-                
-                pthread_mutex_unlock(&g_images_mutex);
-                return &g_images[i];
-            }
+// Drops one reference, the shard lock is held
+void image_unref(Image *img) {
+    if (--img->refs > 0)
+        return;
+    free(img->image_data);
+    sem_destroy(&img->semafor);
+    free(img);
+}
+
+// Takes the image out of the cache, clients sending it keep their references
+void cache_remove(CacheShard *shard, Image *img) {
+    Image **link = image_bucket(shard, img->hash);
+    while (*link != img)
+        link = &(*link)->hash_next;
+    *link = img->hash_next;
+    lru_unlink(img);
+    img->lru_prev = img->lru_next = NULL;
+    if (img->state == IMAGE_READY)
+        shard->bytes -= img->size;
+    image_unref(img);
+}
 
-            // If .jpg loading failed, try .png
-            snprintf(filename, sizeof(filename), "%s.png", season); 
-            if (load_image(filename, &g_images[i]) == 0) {
+// Evicts least recently used images until the shard fits its budget,
+// images still loading are skipped and the newest one always stays
+void cache_evict(CacheShard *shard) {
+    Image *img = shard->lru.lru_prev;
+    while (shard->bytes > g_shard_budget && img != shard->lru.lru_next) {
+        Image *prev = img->lru_prev;
+        if (img->state == IMAGE_READY) {
+            log_msg(LOG_DEBUG, "Image '%s' evicted from cache.", img->image_name);
+            cache_remove(shard, img);
+        }
+        img = prev;
+    }
+}
 
-                strncpy(g_images[i].image_name, season, BUFFER_SIZE - 1);
-                g_images[i].image_name[BUFFER_SIZE - 1] = '\0';
+// Reads the image of the season from disk, .jpg first and then .png
+int load_season(const char *season, Image *img) {
+    char filename[BUFFER_SIZE];
+    snprintf(filename, sizeof(filename), "%s.jpg", season); 
+    if (load_image(filename, img) == 0)
+        return 0;
 
-                pthread_mutex_unlock(&g_images_mutex);
-                return &g_images[i];
-            }
+    // If .jpg loading failed, try .png
+    snprintf(filename, sizeof(filename), "%s.png", season); 
+    return load_image(filename, img);
+}
 
-            // If both failed, return NULL
-            pthread_mutex_unlock(&g_images_mutex);
-            return NULL;
+// Find or load image by season name. The image is referenced until
+// release_image, so eviction cannot free it while it is being sent.
+// Only the first client asking for a missing image reads it from disk,
+// the others wait for that read on the shard condition.
+Image* get_or_load_image(const char *season) {
+    unsigned hash = image_hash(season);
+    CacheShard *shard = image_shard(hash);
+    pthread_mutex_lock(&shard->lock);
 
+    // Find the image
+    Image *img = *image_bucket(shard, hash);
+    while (img && (img->hash != hash || strcmp(season, img->image_name) != 0))
+        img = img->hash_next;
+
+    if (img) {
+        img->refs++;
+        while (img->state == IMAGE_LOADING)
+            pthread_cond_wait(&shard->loaded, &shard->lock);
+        if (img->state == IMAGE_FAILED) {
+            image_unref(img);
+            img = NULL;
+        }else if (img->lru_next) {  // not evicted while we waited
+            lru_unlink(img);
+            lru_push(shard, img);
         }
+        pthread_mutex_unlock(&shard->lock);
+        return img;
     }
 
-    pthread_mutex_unlock(&g_images_mutex);
-    return NULL;
+    // Load the image if not found, the entry makes others wait for it
+    img = (Image*)calloc(1, sizeof(Image));
+    if (!img) {
+        pthread_mutex_unlock(&shard->lock);
+        perror("Failed to allocate memory for image");
+        return NULL;
+    }
+    strncpy(img->image_name, season, BUFFER_SIZE - 1);
+    img->image_name[BUFFER_SIZE - 1] = '\0';
+    sem_init(&img->semafor, 0, 1); // Initialize semaphore to 1
+    img->hash = hash;
+    img->state = IMAGE_LOADING;
+    img->refs = 2;
+    Image **bucket = image_bucket(shard, hash);
+    img->hash_next = *bucket;
+    *bucket = img;
+    lru_push(shard, img);
+    pthread_mutex_unlock(&shard->lock);
+
+    int res = load_season(season, img);
+
+    pthread_mutex_lock(&shard->lock);
+    if (res == 0) {
+        img->state = IMAGE_READY;
+        shard->bytes += img->size;
+        cache_evict(shard);
+    }else{
+        // If both failed, return NULL
+        img->state = IMAGE_FAILED;
+        cache_remove(shard, img);
+        image_unref(img);
+        img = NULL;
+    }
+    pthread_cond_broadcast(&shard->loaded);
+    pthread_mutex_unlock(&shard->lock);
+    return img;
+}
+
+// Returns the image taken by get_or_load_image
+void release_image(Image *img) {
+    CacheShard *shard = image_shard(img->hash);
+    pthread_mutex_lock(&shard->lock);
+    image_unref(img);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_destroy() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &g_cache[i];
+        while (shard->lru.lru_next != &shard->lru)
+            cache_remove(shard, shard->lru.lru_next);
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->loaded);
+    }
 }
 
 // Function to handle each client connection
@@ -194,6 +347,7 @@ void* client_handler(void *arg) {
             }
 
             sem_post(&img->semafor); // Release access to the image
+            release_image(img);
         }else{
             write(client_socket, "Invalid command\n", sizeof("Invalid command\n"));
         }
@@ -204,17 +358,20 @@ void* client_handler(void *arg) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port_number\n", argv[0]);
+    long cache_bytes = DEFAULT_CACHE_BYTES;
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        cache_bytes = atol(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2 || cache_bytes <= 0) {
+        fprintf(stderr, "Usage: %s [-c cache_bytes] port_number\n", argv[0]);
         exit(1);
     }
     int port = atoi(argv[1]);
 
-    // Initialize image semaphores
-    for (int i = 0; i < MAX_IMAGES; i++) {
-        g_images[i].image_data = NULL;
-        sem_init(&g_images[i].semafor, 0, 1); // Initialize semaphore to 1
-    }
+    // Initialize the image cache
+    cache_init(cache_bytes);
 
     // Create server socket
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -234,7 +391,7 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (listen(server_socket, MAX_IMAGES) < 0) {
+    if (listen(server_socket, LISTEN_BACKLOG) < 0) {
         perror("listen failed");
         close(server_socket);
         exit(1);
@@ -268,10 +425,7 @@ int main(int argc, char *argv[]) {
     close(server_socket);
 
     // Free image memory and destroy semaphores
-    for (int i = 0; i < MAX_IMAGES; i++) {
-        if (g_images[i].image_data) free(g_images[i].image_data);
-        sem_destroy(&g_images[i].semafor);
-    }
+    cache_destroy();
 
     return 0;
 }